@@ -1,16 +1,84 @@
-__kernel void grey_shade(__global const int* restrict R,
-			 __global const int* restrict G,
-			 __global const int* restrict B,
-			 __global int* restrict grey){
+__kernel void grey_shade(__global const uchar4* restrict rgba,
+			 __global uchar* restrict grey){
 	int id = get_global_id(0);
-	grey[id] = (R[id] + G[id] + B[id])/3;
+	uchar4 px = rgba[id];
+	grey[id] = (px.x + px.y + px.z)/3;
 
 }
 
-__kernel void sobel(	__global const int* restrict img,
+__kernel void clear_buffer(__global int* restrict buf){
+	buf[get_global_id(0)] = 0;
+}
+
+// gradient magnitude of the sobel kernels, SOBEL_MAG is set at build time
+#define SOBEL_MAG_SUM 0		// gradX + gradY, keeps one gradient sign only
+#define SOBEL_MAG_L1 1		// |gradX| + |gradY|
+#define SOBEL_MAG_L2 2		// exact sqrt(gradX^2 + gradY^2)
+#define SOBEL_MAG_L2_FAST 3	// max + 3/8 min, within 7% of L2
+#ifndef SOBEL_MAG
+#define SOBEL_MAG SOBEL_MAG_SUM
+#endif
+
+// edge pixels have a magnitude of at least SOBEL_THRESHOLD
+#ifndef SOBEL_THRESHOLD
+#define SOBEL_THRESHOLD 150
+#endif
+
+/**
+ * Magnitude of the sobel gradient. The variant is fixed when the program
+ * is built (-DSOBEL_MAG, host -m) so every kernel gets it without branch.
+ */
+int gradMagnitude(int gradX, int gradY){
+#if SOBEL_MAG == SOBEL_MAG_L1
+	return abs(gradX) + abs(gradY);
+#elif SOBEL_MAG == SOBEL_MAG_L2
+	return (int) sqrt((float) (gradX * gradX + gradY * gradY));
+#elif SOBEL_MAG == SOBEL_MAG_L2_FAST
+	int a = abs(gradX);
+	int b = abs(gradY);
+	return max(a, b) + ((3 * min(a, b)) >> 3);
+#else
+	return gradX + gradY;
+#endif
+}
+
+// gradMagnitude on 8 lanes, for sobelSeparable
+int8 gradMagnitude8(int8 gradX, int8 gradY){
+#if SOBEL_MAG == SOBEL_MAG_L1
+	return convert_int8(abs(gradX) + abs(gradY));
+#elif SOBEL_MAG == SOBEL_MAG_L2
+	return convert_int8(sqrt(convert_float8(gradX * gradX + gradY * gradY)));
+#elif SOBEL_MAG == SOBEL_MAG_L2_FAST
+	int8 a = convert_int8(abs(gradX));
+	int8 b = convert_int8(abs(gradY));
+	return max(a, b) + ((3 * min(a, b)) >> 3);
+#else
+	return gradX + gradY;
+#endif
+}
+
+/**
+ * phi bin of the line through an edge pixel : its normal is the gradient,
+ * folded in [0, pi) since (phi + pi, -r) is the same line. Written by the
+ * sobel kernels in dir for houghLineOriented, only on edge pixels.
+ */
+short gradientPhi(int gradX, int gradY, float discStepPhi, int phiDim){
+	float theta = atan2((float) gradY, (float) gradX);
+
+	if(theta < 0){
+		theta += M_PI_F;
+	}
+
+	return (short) min((int) (theta / discStepPhi), phiDim - 1);
+}
+
+__kernel void sobel(	__global const uchar* restrict img,
 		 	int w, 
 			int totPx,
-			__global int* restrict sobel){
+			__global int* restrict sobel,
+			__global short* restrict dir, // NULL if not needed
+			float discStepPhi,
+			int phiDim){
 
 	int id = get_global_id(0);
 
@@ -23,6 +91,7 @@ __kernel void sobel(	__global const int* restrict img,
 		id > (totPx - w) || 
 		id % w == 0 || 
 		id % w == (w - 1) ){
+		sobel[id] = 0; // no edge on the sides
 	}else{
 		gradX = - img[id - w -1] - 2 * img[id -1] - img[id + w -1]
 			+ img[id - w +1] + 2 * img[id +1] + img[id + w +1];
@@ -30,42 +99,1147 @@ __kernel void sobel(	__global const int* restrict img,
 		gradY = - img[id - w -1] - 2 * img[id -w] - img[id - w +1]
 			+ img[id + w -1] + 2 * img[id +w] + img[id + w +1];
 
-		//grad = sqrt(gradX * gradX + gradY * gradY); // FPGA code
-          grad = gradX + gradY; // intel CPU code
+		grad = gradMagnitude(gradX, gradY);
 
-		if(grad < 150){
+		if(grad < SOBEL_THRESHOLD){
 			sobel[id] = 0;
 		}else if (grad > 255){
 			sobel[id] = 255;
 		}else{
 			sobel[id] = grad;
 		}
+
+		if(dir != NULL && grad >= SOBEL_THRESHOLD){
+			dir[id] = gradientPhi(gradX, gradY, discStepPhi, phiDim);
+		}
 	}
 }
 
-__kernel void houghLine(	__global const int* restrict img,
-				__global const float* restrict cosinus,
-				__global const float* restrict sinus,
-				int width,
-				int rDim,
-				int phiDim,
-				float discStepR,
-				__global int* acc){
-	
+// side of the sobelTiled / greySobel work-group, SOBEL_TILE host side
+#define SOBEL_TILE 16
+
+// thresholded gradient of the pixel at tile[ly + 1][lx + 1], as sobel,
+// its components are kept in gx / gy for the direction
+int sobelFromTile(__local const uchar (*tile)[SOBEL_TILE + 2], int lx, int ly,
+		int* gx, int* gy){
+	int gradX = - tile[ly][lx] - 2 * tile[ly + 1][lx] - tile[ly + 2][lx]
+		+ tile[ly][lx + 2] + 2 * tile[ly + 1][lx + 2] + tile[ly + 2][lx + 2];
+
+	int gradY = - tile[ly][lx] - 2 * tile[ly][lx + 1] - tile[ly][lx + 2]
+		+ tile[ly + 2][lx] + 2 * tile[ly + 2][lx + 1] + tile[ly + 2][lx + 2];
+
+	int grad = gradMagnitude(gradX, gradY);
+
+	*gx = gradX;
+	*gy = gradY;
+	return grad < SOBEL_THRESHOLD ? 0 : min(grad, 255);
+}
+
+/**
+ * Same filter as sobel on a 2D NDRange of 16x16 work-groups. The tile and
+ * its one pixel halo are loaded once in local memory, the nine neighbours
+ * of each pixel are then read from there. The NDRange is rounded up to
+ * whole tiles, out of image loads are clamped and never written back.
+ */
+__kernel __attribute__((reqd_work_group_size(SOBEL_TILE,SOBEL_TILE,1)))
+void sobelTiled(__global const uchar* restrict img,
+		int w,
+		int h,
+		__global int* restrict sobel,
+		__global short* restrict dir, // NULL if not needed
+		float discStepPhi,
+		int phiDim){
+
+	__local uchar tile[SOBEL_TILE + 2][SOBEL_TILE + 2];
+
+	int lx = get_local_id(0);
+	int ly = get_local_id(1);
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+
+	// (tile + 2)^2 block starting one pixel up left of the tile
+	int bx = get_group_id(0) * SOBEL_TILE - 1;
+	int by = get_group_id(1) * SOBEL_TILE - 1;
+
+	for(int ty = ly; ty < SOBEL_TILE + 2; ty += SOBEL_TILE){
+		int gy = clamp(by + ty, 0, h - 1);
+		for(int tx = lx; tx < SOBEL_TILE + 2; tx += SOBEL_TILE){
+			int gx = clamp(bx + tx, 0, w - 1);
+			tile[ty][tx] = img[gy * w + gx];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if(x >= w || y >= h){
+		return;
+	}
+
+	// we dont want to evaluate anything on the sides
+	if(x == 0 || y == 0 || x == w - 1 || y == h - 1){
+		sobel[y * w + x] = 0;
+		return;
+	}
+
+	int gx, gy;
+	int edge = sobelFromTile(tile, lx, ly, &gx, &gy);
+
+	sobel[y * w + x] = edge;
+	if(dir != NULL && edge != 0){
+		dir[y * w + x] = gradientPhi(gx, gy, discStepPhi, phiDim);
+	}
+}
+
+/**
+ * grey_shade and sobelTiled in one kernel : the tile and its halo are
+ * read as RGBA and converted to grey while being staged in local memory,
+ * the grey image never goes through global memory.
+ */
+__kernel __attribute__((reqd_work_group_size(SOBEL_TILE,SOBEL_TILE,1)))
+void greySobel(	__global const uchar4* restrict rgba,
+		int w,
+		int h,
+		__global int* restrict sobel,
+		__global short* restrict dir, // NULL if not needed
+		float discStepPhi,
+		int phiDim){
+
+	__local uchar tile[SOBEL_TILE + 2][SOBEL_TILE + 2];
+
+	int lx = get_local_id(0);
+	int ly = get_local_id(1);
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+
+	int bx = get_group_id(0) * SOBEL_TILE - 1;
+	int by = get_group_id(1) * SOBEL_TILE - 1;
+
+	for(int ty = ly; ty < SOBEL_TILE + 2; ty += SOBEL_TILE){
+		int gy = clamp(by + ty, 0, h - 1);
+		for(int tx = lx; tx < SOBEL_TILE + 2; tx += SOBEL_TILE){
+			int gx = clamp(bx + tx, 0, w - 1);
+			uchar4 px = rgba[gy * w + gx];
+			tile[ty][tx] = (px.x + px.y + px.z)/3; // as grey_shade
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if(x >= w || y >= h){
+		return;
+	}
+
+	// we dont want to evaluate anything on the sides
+	if(x == 0 || y == 0 || x == w - 1 || y == h - 1){
+		sobel[y * w + x] = 0;
+		return;
+	}
+
+	int gx, gy;
+	int edge = sobelFromTile(tile, lx, ly, &gx, &gy);
+
+	sobel[y * w + x] = edge;
+	if(dir != NULL && edge != 0){
+		dir[y * w + x] = gradientPhi(gx, gy, discStepPhi, phiDim);
+	}
+}
+
+// pixels of a row per sobelSeparable work-item, SOBEL_VEC host side
+#define SOBEL_VEC 8
+
+/**
+ * Same filter as sobel split in its two 1D passes, SOBEL_VEC pixels of a
+ * row per work-item. The vertical pass runs once per column on the three
+ * rows read with vload16 : [1 2 1] smoothing for gradX, [-1 0 1] difference
+ * for gradY. The horizontal pass combines the columns of each pixel :
+ * [-1 0 1] for gradX, [1 2 1] for gradY. Chunks touching the left or right
+ * side, or too close to the end of the row for vload16, take the scalar
+ * path with the same passes.
+ */
+__kernel void sobelSeparable(	__global const uchar* restrict img,
+				int w,
+				int h,
+				__global int* restrict sobel,
+				__global short* restrict dir, // NULL if not needed
+				float discStepPhi,
+				int phiDim){
+
+	int x0 = get_global_id(0) * SOBEL_VEC;
+	int y = get_global_id(1);
+
+	__global int* out = sobel + y * w + x0;
+
+	// we dont want to evaluate anything on the top and bottom rows
+	if(y == 0 || y == h - 1){
+		for(int i = 0; i < SOBEL_VEC && x0 + i < w; i++){
+			out[i] = 0;
+		}
+		return;
+	}
+
+	__global const uchar* up = img + (y - 1) * w + x0;
+	__global const uchar* mid = up + w;
+	__global const uchar* down = mid + w;
+
+	if(x0 > 0 && x0 + 2 * SOBEL_VEC - 1 <= w){
+		// columns x0 - 1 .. x0 + 14, only the first 10 are used
+		short16 u = convert_short16(vload16(0, up - 1));
+		short16 m = convert_short16(vload16(0, mid - 1));
+		short16 d = convert_short16(vload16(0, down - 1));
+
+		short16 smooth = u + (short) 2 * m + d;
+		short16 diff = d - u;
+
+		short8 gradX = smooth.s23456789 - smooth.s01234567;
+		short8 gradY = diff.s01234567 + (short) 2 * diff.s12345678
+			+ diff.s23456789;
+		int8 grad = gradMagnitude8(convert_int8(gradX), convert_int8(gradY));
+
+		int8 res = select(min(grad, (int8)(255)), (int8)(0),
+			grad < (int8)(SOBEL_THRESHOLD));
+		vstore8(res, 0, out);
+
+		// lane by lane, only edge pixels need atan2
+		if(dir != NULL){
+			short gx[SOBEL_VEC], gy[SOBEL_VEC];
+			int edge[SOBEL_VEC];
+			vstore8(gradX, 0, gx);
+			vstore8(gradY, 0, gy);
+			vstore8(res, 0, edge);
+
+			for(int i = 0; i < SOBEL_VEC; i++){
+				if(edge[i] != 0){
+					dir[y * w + x0 + i] = gradientPhi(gx[i], gy[i],
+						discStepPhi, phiDim);
+				}
+			}
+		}
+		return;
+	}
+
+	for(int i = 0; i < SOBEL_VEC && x0 + i < w; i++){
+		int x = x0 + i;
+
+		if(x == 0 || x == w - 1){
+			out[i] = 0;
+			continue;
+		}
+
+		int smoothL = up[i - 1] + 2 * mid[i - 1] + down[i - 1];
+		int smoothR = up[i + 1] + 2 * mid[i + 1] + down[i + 1];
+		int gradX = smoothR - smoothL;
+		int gradY = (down[i - 1] - up[i - 1]) + 2 * (down[i] - up[i])
+			+ (down[i + 1] - up[i + 1]);
+		int grad = gradMagnitude(gradX, gradY);
+
+		out[i] = grad < SOBEL_THRESHOLD ? 0 : min(grad, 255);
+		if(dir != NULL && grad >= SOBEL_THRESHOLD){
+			dir[y * w + x] = gradientPhi(gradX, gradY, discStepPhi, phiDim);
+		}
+	}
+}
+
+// row length of the sobelSWI line buffer, SOBEL_SWI_WIDTH host side
+#ifndef SOBEL_SWI_WIDTH
+#define SOBEL_SWI_WIDTH 2048
+#endif
+#define SOBEL_SWI_TAPS (2 * SOBEL_SWI_WIDTH + 3)
+
+/**
+ * Single work-item sobel for the FPGA (launched as a task). The grey band
+ * is streamed once in raster order through a shift register of two rows
+ * plus three pixels, the 3x3 window sits at fixed taps of it : one global
+ * read, one output and one write per iteration. Rows are padded to
+ * SOBEL_SWI_WIDTH with zeros so the taps do not depend on w, the padding
+ * iterations neither read nor write. Same output as sobel.
+ */
+__kernel void sobelSWI(	__global const uchar* restrict img,
+			int w,
+			int h,
+			__global int* restrict sobel,
+			__global short* restrict dir, // NULL if not needed
+			float discStepPhi,
+			int phiDim){
+
+	uchar taps[SOBEL_SWI_TAPS];
+
+	#pragma unroll
+	for(int i = 0; i < SOBEL_SWI_TAPS; i++){
+		taps[i] = 0;
+	}
+
+	// pixel entering the buffer, and center of the window one row and one
+	// pixel behind it
+	int inX = 0;
+	int inY = 0;
+	int x = SOBEL_SWI_WIDTH - 1;
+	int y = -2;
+
+	int nbIter = h * SOBEL_SWI_WIDTH + w + 1;
+	for(int it = 0; it < nbIter; it++){
+		#pragma unroll
+		for(int i = SOBEL_SWI_TAPS - 1; i > 0; i--){
+			taps[i] = taps[i - 1];
+		}
+		taps[0] = inX < w && inY < h ? img[inY * w + inX] : 0;
+
+		if(y >= 0 && x < w){
+			int out = 0;
+
+			// we dont want to evaluate anything on the sides
+			if(x > 0 && y > 0 && x < w - 1 && y < h - 1){
+				int gradX = - taps[2 * SOBEL_SWI_WIDTH + 2]
+					- 2 * taps[SOBEL_SWI_WIDTH + 2] - taps[2]
+					+ taps[2 * SOBEL_SWI_WIDTH]
+					+ 2 * taps[SOBEL_SWI_WIDTH] + taps[0];
+
+				int gradY = - taps[2 * SOBEL_SWI_WIDTH + 2]
+					- 2 * taps[2 * SOBEL_SWI_WIDTH + 1]
+					- taps[2 * SOBEL_SWI_WIDTH]
+					+ taps[2] + 2 * taps[1] + taps[0];
+
+				int grad = gradMagnitude(gradX, gradY);
+				out = grad < SOBEL_THRESHOLD ? 0 : min(grad, 255);
+
+				if(dir != NULL && grad >= SOBEL_THRESHOLD){
+					dir[y * w + x] = gradientPhi(gradX, gradY, discStepPhi,
+						phiDim);
+				}
+			}
+			sobel[y * w + x] = out;
+		}
+
+		inX++;
+		if(inX == SOBEL_SWI_WIDTH){
+			inX = 0;
+			inY++;
+		}
+		x++;
+		if(x == SOBEL_SWI_WIDTH){
+			x = 0;
+			y++;
+		}
+	}
+}
+
+// Canny thresholds on the gradient magnitude of the blurred image
+#ifndef CANNY_LOW
+#define CANNY_LOW 100
+#endif
+#ifndef CANNY_HIGH
+#define CANNY_HIGH 200
+#endif
+
+/**
+ * Canny, 1st stage : 5x5 gaussian blur of the grey band with the binomial
+ * weights 1 4 6 4 1 (sigma ~1, 256 in total). Neighbours out of the
+ * buffer are clamped to its border. 2D NDRange, one work-item per pixel.
+ */
+__kernel void cannyBlur(__global const uchar* restrict img,
+			int w,
+			int h,
+			__global uchar* restrict blur){
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	const int weight[5] = {1, 4, 6, 4, 1};
+
+	int sum = 0;
+	for(int j = -2; j <= 2; j++){
+		int yy = clamp(y + j, 0, h - 1);
+
+		for(int i = -2; i <= 2; i++){
+			int xx = clamp(x + i, 0, w - 1);
+			sum += weight[j + 2] * weight[i + 2] * img[yy * w + xx];
+		}
+	}
+
+	blur[y * w + x] = (uchar) ((sum + 128) >> 8);
+}
+
+/**
+ * Canny, 2nd stage : sobel gradient of the blurred band. mag gets its
+ * magnitude and sector its direction rounded to 0, 45, 90 or 135 degrees
+ * (0 to 3) for cannyNMS. dir gets the phi bin of the
+ * normal as in the sobel kernels, NULL if not needed.
+ */
+__kernel void cannyGradient(	__global const uchar* restrict blur,
+				int w,
+				int h,
+				__global short* restrict mag,
+				__global uchar* restrict sector,
+				__global short* restrict dir, // NULL if not needed
+				float discStepPhi,
+				int phiDim){
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int id = y * w + x;
+
+	// we dont want to evaluate anything on the sides
+	if(x == 0 || y == 0 || x == w - 1 || y == h - 1){
+		mag[id] = 0;
+		sector[id] = 0;
+		return;
+	}
+
+	int gradX = - blur[id - w - 1] - 2 * blur[id - 1] - blur[id + w - 1]
+		+ blur[id - w + 1] + 2 * blur[id + 1] + blur[id + w + 1];
+
+	int gradY = - blur[id - w - 1] - 2 * blur[id - w] - blur[id - w + 1]
+		+ blur[id + w - 1] + 2 * blur[id + w] + blur[id + w + 1];
+
+	int absX = abs(gradX);
+	int absY = abs(gradY);
+
+	// tan(22.5 deg) ~ 53 / 128
+	uchar s;
+	if(absY * 128 <= absX * 53){
+		s = 0;
+	}else if(absX * 128 <= absY * 53){
+		s = 2;
+	}else{
+		s = (gradX > 0) == (gradY > 0) ? 1 : 3;
+	}
+
+	// canny needs a true magnitude, the signed sum is replaced by L1
+#if SOBEL_MAG == SOBEL_MAG_SUM
+	mag[id] = (short) (absX + absY);
+#else
+	mag[id] = (short) gradMagnitude(gradX, gradY);
+#endif
+	sector[id] = s;
+
+	if(dir != NULL){
+		dir[id] = gradientPhi(gradX, gradY, discStepPhi, phiDim);
+	}
+}
+
+/**
+ * Canny, 3rd stage : non-maximum suppression. A pixel stays only if its
+ * magnitude is a maximum along its gradient, ties go to the first of the
+ * two neighbours so flat ridges stay one pixel wide. state gets 0 (no
+ * edge), 1 (weak, above CANNY_LOW) or 2 (strong, above CANNY_HIGH).
+ */
+__kernel void cannyNMS(	__global const short* restrict mag,
+			__global const uchar* restrict sector,
+			int w,
+			int h,
+			__global uchar* restrict state){
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int id = y * w + x;
+
+	int m = mag[id];
+
+	if(x == 0 || y == 0 || x == w - 1 || y == h - 1 || m < CANNY_LOW){
+		state[id] = 0;
+		return;
+	}
+
+	// neighbour along the gradient, y goes down the image
+	int step;
+	switch(sector[id]){
+		case 0: step = 1; break;
+		case 1: step = w + 1; break;
+		case 2: step = w; break;
+		default: step = - w + 1; break;
+	}
+
+	bool maximum = m > mag[id + step] && m >= mag[id - step];
+	state[id] = !maximum ? 0 : (m >= CANNY_HIGH ? 2 : 1);
+}
+
+/**
+ * Canny, 4th stage : one hysteresis pass, a weak pixel next to a strong
+ * one becomes strong. Run in place a fixed number of times by the host,
+ * states only go from weak to strong so the races between neighbours
+ * only let a pass reach further.
+ */
+__kernel void cannyHysteresis(	__global uchar* state,
+				int w,
+				int h){
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int id = y * w + x;
+
+	// borders are never weak
+	if(state[id] != 1){
+		return;
+	}
+
+	for(int j = -1; j <= 1; j++){
+		for(int i = -1; i <= 1; i++){
+			if(state[id + j * w + i] == 2){
+				state[id] = 2;
+				return;
+			}
+		}
+	}
+}
+
+/**
+ * Canny, last stage : edge image in the format of the sobel kernels,
+ * strong pixels get their magnitude capped at 255, the others 0. Only
+ * rows [first, last) of the band are kept, its wider halos never vote.
+ */
+__kernel void cannyEdges(	__global const uchar* restrict state,
+				__global const short* restrict mag,
+				int w,
+				int first,
+				int last,
+				__global int* restrict edges){
+
 	int id = get_global_id(0);
+	int y = id / w;
 
-	// pos in x = k * width + posX in current line
-	// pos in y = id / width 
-	int x = id % width;
-	int y = id / width; // always floored result when div two positive int
+	if(state[id] == 2 && y >= first && y < last){
+		edges[id] = min((int) mag[id], 255);
+	}else{
+		edges[id] = 0;
+	}
+}
+
+// work-items of a compactEdges group, COMPACT_GROUP host side
+#define COMPACT_GROUP 256
+
+/**
+ * Stream compaction of the edge image of a band : every edge pixel is
+ * appended to edges as (y << 16) | x, buffer coordinates, with its value
+ * in values and count ends up with their number (reset by the host).
+ * A local atomic gives each edge its rank in the work-group, then one
+ * global atomic per group reserves its run of the list. The order of the
+ * runs depends on the scheduling, the votes do not. The NDRange is
+ * rounded up to whole groups, the extra work-items hold no edge.
+ */
+__kernel __attribute__((reqd_work_group_size(COMPACT_GROUP,1,1)))
+void compactEdges(	__global const int* restrict img,
+			int w,
+			int totPx,
+			__global uint* restrict edges,
+			__global uchar* restrict values,
+			__global int* restrict count){
+
+	__local int groupCount;
+	__local int groupBase;
+
+	int id = get_global_id(0);
+	int edge = id < totPx ? img[id] : 0;
+
+	if(get_local_id(0) == 0){
+		groupCount = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int rank = edge != 0 ? atomic_inc(&groupCount) : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if(get_local_id(0) == 0){
+		groupBase = atomic_add(count, groupCount);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if(edge != 0){
+		edges[groupBase + rank] = ((uint) (id / w) << 16) | (uint) (id % w);
+		values[groupBase + rank] = (uchar) edge;
+	}
+}
+
+// fractional bits of the fixed-point cos / sin tables of the hough
+// kernels, HOUGH_FRAC_BITS host side. The tables are scaled by
+// 2^HOUGH_FRAC_BITS / discStepR, the r of a vote is x * cos + y * sin in
+// integers and needs no divide.
+#define HOUGH_FRAC_BITS 16
+
+// r bin of a fixed-point r, truncated toward 0 as the float cast was
+int rBin(int rFixed){
+	return rFixed >= 0 ? rFixed >> HOUGH_FRAC_BITS
+		: -(-rFixed >> HOUGH_FRAC_BITS);
+}
+
+// counters of the hough accumulator, 16 bits saturating with
+// -DHOUGH_ACC16 (host -a 16) for half the memory and read back
+#ifdef HOUGH_ACC16
+typedef ushort acc_t;
+#define ACC_MAX 0xFFFF
+#else
+typedef int acc_t;
+#endif
+
+/**
+ * Adds v votes to bin i of the accumulator from any work-item. There are
+ * no 16 bit atomics in OpenCL 1.x, the counter is updated with a compare
+ * and swap of the 32 bit word holding it (little endian as on the host)
+ * and stops at ACC_MAX.
+ */
+void accAdd(__global acc_t* acc, int i, int v){
+#ifdef HOUGH_ACC16
+	volatile __global uint* word = (volatile __global uint*) acc + (i >> 1);
+	int shift = (i & 1) * 16;
+	uint old = *word;
+
+	for(;;){
+		uint count = (old >> shift) & ACC_MAX;
+		uint sum = min(count + (uint) v, (uint) ACC_MAX);
+
+		if(sum == count){
+			return;
+		}
+
+		uint seen = atomic_cmpxchg(word, old,
+			(old & ~((uint) ACC_MAX << shift)) | (sum << shift));
+		if(seen == old){
+			return;
+		}
+		old = seen;
+	}
+#else
+	atomic_add(&acc[i], v);
+#endif
+}
+
+// same without atomics, for the single work-item kernel
+acc_t accSum(acc_t count, int v){
+#ifdef HOUGH_ACC16
+	return min((int) count + v, ACC_MAX);
+#else
+	return count + v;
+#endif
+}
+
+/**
+ * Hough voting, one 16x16 work-group per tile of pixels (HOUGH_TILE host side).
+ * For a band of phi the r of a tile only spans a window of win bins, the
+ * votes are gathered in that local slice with local atomics and merged in
+ * the global accumulator with one atomic per non empty bin.
+ * img holds height rows starting at image row yOffset (band of the image
+ * split across devices), votes use the image coordinates.
+ * Every hough kernel stores r at rNeg + r in its row of rDim bins, the
+ * negative r of phi > pi/2 included.
+ */
+__kernel __attribute__((reqd_work_group_size(16,16,1)))
+void houghLine(	__global const int* restrict img,
+		__global const int* restrict cosinus,
+		__global const int* restrict sinus,
+		int width,
+		int height,
+		int rDim,
+		int rNeg,
+		int phiDim,
+		__global acc_t* acc,
+		__local int* slice,
+		int phiBand,
+		int win,
+		int yOffset){
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	int groupSize = get_local_size(0) * get_local_size(1);
+
+	// tile corners
+	int x0 = get_group_id(0) * get_local_size(0);
+	int y0 = get_group_id(1) * get_local_size(1) + yOffset;
+	int x1 = x0 + get_local_size(0) - 1;
+	int y1 = y0 + get_local_size(1) - 1;
+
+	__local int nbEdges;
+
+	if(lid == 0){
+		nbEdges = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
 	// if the pixel is not 0 we are on an edge
-	if(img[id] != 0){
-		for(int phi = 0; phi < phiDim; phi ++){
-			float rFloat = x * cosinus[phi] + y * sinus[phi];
-			int r = (int) (rFloat / discStepR);
-			acc[ rDim * phi + r ] += 1;
+	bool edge = x < width && y < height && img[y * width + x] != 0;
+	if(edge){
+		atomic_inc(&nbEdges);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// same value for the whole group, nothing to vote in this tile
+	if(nbEdges == 0){
+		return;
+	}
+
+	for(int band = 0; band < phiDim; band += phiBand){
+		int nbPhi = min(phiBand, phiDim - band);
+
+		for(int i = lid; i < nbPhi * win; i += groupSize){
+			slice[i] = 0;
 		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if(edge){
+			for(int k = 0; k < nbPhi; k++){
+				int c = cosinus[band + k];
+				int s = sinus[band + k];
+
+				// smallest r of the tile is on one of its corners, one
+				// bin of margin
+				int rMin = (c < 0 ? x1 : x0) * c + (s < 0 ? y1 : y0) * s;
+				int rBase = rBin(rMin) - 1;
+
+				int r = rBin(x * c + (y + yOffset) * s);
+				atomic_inc(&slice[k * win + r - rBase]);
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// merge the slice, one global atomic per non empty bin
+		for(int i = lid; i < nbPhi * win; i += groupSize){
+			int votes = slice[i];
+
+			if(votes != 0){
+				int phi = band + i / win;
+				int c = cosinus[phi];
+				int s = sinus[phi];
+				int rMin = (c < 0 ? x1 : x0) * c + (s < 0 ? y1 : y0) * s;
+				int rBase = rBin(rMin) - 1;
+
+				accAdd(acc, rDim * phi + rNeg + rBase + i % win, votes);
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
 } 
+
+/**
+ * Hough voting restricted to the gradient direction : an edge pixel only
+ * votes for the 2 * phiWin + 1 phi around the phi of its normal (dir from
+ * the sobel kernels), wrapping around pi where the r of the line changes
+ * sign. One work-item per pixel of the band (see houghLine for yOffset),
+ * the few votes go straight to the global accumulator.
+ */
+__kernel void houghLineOriented(__global const int* restrict img,
+				__global const short* restrict dir,
+				__global const int* restrict cosinus,
+				__global const int* restrict sinus,
+				int width,
+				int height,
+				int rDim,
+				int rNeg,
+				int phiDim,
+				__global acc_t* acc,
+				int phiWin,
+				int yOffset){
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int id = y * width + x;
+
+	if(img[id] == 0){
+		return;
+	}
+
+	int center = dir[id];
+	for(int k = -phiWin; k <= phiWin; k++){
+		int phi = center + k;
+		phi += phi < 0 ? phiDim : (phi >= phiDim ? -phiDim : 0);
+
+		int r = rBin(x * cosinus[phi] + (y + yOffset) * sinus[phi]);
+		accAdd(acc, rDim * phi + rNeg + r, 1);
+	}
+}
+
+/**
+ * houghLine over the edge list of compactEdges : one work-item per edge,
+ * no pixel without edge is ever visited. The count is only known on the
+ * device, the host launches a fixed NDRange that walks the list with a
+ * stride of its size. Votes go straight to the global accumulator.
+ */
+__kernel void houghLineList(	__global const uint* restrict edges,
+				__global const int* restrict count,
+				__global const int* restrict cosinus,
+				__global const int* restrict sinus,
+				int rDim,
+				int rNeg,
+				int phiDim,
+				__global acc_t* acc,
+				int yOffset){
+
+	int nbEdges = *count;
+
+	for(int e = get_global_id(0); e < nbEdges; e += get_global_size(0)){
+		int x = edges[e] & 0xFFFF;
+		int y = (edges[e] >> 16) + yOffset;
+
+		for(int phi = 0; phi < phiDim; phi++){
+			int r = rBin(x * cosinus[phi] + y * sinus[phi]);
+			accAdd(acc, rDim * phi + rNeg + r, 1);
+		}
+	}
+}
+
+// houghLineOriented over the edge list, walked as in houghLineList
+__kernel void houghLineOrientedList(__global const uint* restrict edges,
+				__global const int* restrict count,
+				__global const short* restrict dir,
+				__global const int* restrict cosinus,
+				__global const int* restrict sinus,
+				int width,
+				int rDim,
+				int rNeg,
+				int phiDim,
+				__global acc_t* acc,
+				int phiWin,
+				int yOffset){
+
+	int nbEdges = *count;
+
+	for(int e = get_global_id(0); e < nbEdges; e += get_global_size(0)){
+		int x = edges[e] & 0xFFFF;
+		int y = edges[e] >> 16;
+
+		int center = dir[y * width + x];
+		for(int k = -phiWin; k <= phiWin; k++){
+			int phi = center + k;
+			phi += phi < 0 ? phiDim : (phi >= phiDim ? -phiDim : 0);
+
+			int r = rBin(x * cosinus[phi] + (y + yOffset) * sinus[phi]);
+			accAdd(acc, rDim * phi + rNeg + r, 1);
+		}
+	}
+}
+
+// on-chip accumulator slice of houghLineSWI : SWI_PHI_BANKS x SWI_R_SLICE.
+// Defaults fit in the 32KB local memory of CPU runtimes, the FPGA build
+// (make kernel) uses a larger slice to sweep the image less often.
+#ifndef SWI_PHI_BANKS
+#define SWI_PHI_BANKS 4
+#endif
+#ifndef SWI_R_SLICE
+#define SWI_R_SLICE 1024
+#endif
+
+/**
+ * Single work-item Hough voting for the FPGA (launched as a task).
+ * The edge image is swept in raster order by a pipelined loop once per
+ * slice of SWI_PHI_BANKS phi x SWI_R_SLICE r. Each phi of the slice has its
+ * own bank so the unrolled votes of one pixel never compete for a port.
+ * r ranges over [-rNeg, rDim - rNeg), stored at rNeg + r as in the
+ * NDRange kernel. Rows are offset by yOffset like houghLine.
+ * Along a row the fixed-point r of each bank only grows by its cos.
+ */
+__kernel void houghLineSWI(	__global const int* restrict img,
+				__global const int* restrict cosinus,
+				__global const int* restrict sinus,
+				int width,
+				int height,
+				int rDim,
+				int rNeg,
+				int phiDim,
+				__global acc_t* restrict acc,
+				int yOffset){
+
+	__local int bank[SWI_PHI_BANKS][SWI_R_SLICE];
+
+	for(int band = 0; band < phiDim; band += SWI_PHI_BANKS){
+		int c[SWI_PHI_BANKS];
+		int s[SWI_PHI_BANKS];
+
+		#pragma unroll
+		for(int k = 0; k < SWI_PHI_BANKS; k++){
+			c[k] = band + k < phiDim ? cosinus[band + k] : 0;
+			s[k] = band + k < phiDim ? sinus[band + k] : 0;
+		}
+
+		for(int rStart = -rNeg; rStart < rDim - rNeg; rStart += SWI_R_SLICE){
+
+			for(int r = 0; r < SWI_R_SLICE; r++){
+				#pragma unroll
+				for(int k = 0; k < SWI_PHI_BANKS; k++){
+					bank[k][r] = 0;
+				}
+			}
+
+			// one pixel per iteration
+			for(int y = 0; y < height; y++){
+				int rRow[SWI_PHI_BANKS];
+
+				#pragma unroll
+				for(int k = 0; k < SWI_PHI_BANKS; k++){
+					rRow[k] = (y + yOffset) * s[k];
+				}
+
+				for(int x = 0; x < width; x++){
+					if(img[y * width + x] != 0){
+						#pragma unroll
+						for(int k = 0; k < SWI_PHI_BANKS; k++){
+							int r = rBin(rRow[k]) - rStart;
+
+							if(r >= 0 && r < SWI_R_SLICE){
+								bank[k][r] += 1;
+							}
+						}
+					}
+
+					#pragma unroll
+					for(int k = 0; k < SWI_PHI_BANKS; k++){
+						rRow[k] += c[k];
+					}
+				}
+			}
+
+			// empty bins are skipped
+			int nbR = min(SWI_R_SLICE, rDim - rNeg - rStart);
+			for(int r = 0; r < nbR; r++){
+				#pragma unroll
+				for(int k = 0; k < SWI_PHI_BANKS; k++){
+					if(band + k < phiDim && bank[k][r] != 0){
+						int i = rDim * (band + k) + rNeg + rStart + r;
+						acc[i] = accSum(acc[i], bank[k][r]);
+					}
+				}
+			}
+		}
+	}
+}
+
+/**
+ * First level of the coarse-to-fine hough (-H coarse) : cells of stepPhi x
+ * stepR fine bins, cell (pc, rc) holds the fine phi [pc * stepPhi,
+ * pc * stepPhi + stepPhi) and the fine bins rNeg + r in [rc * stepR,
+ * rc * stepR + stepR). An edge votes in every cell its sinusoid crosses, r
+ * between its values at the first and last phi of the cell plus curv
+ * (fixed-point) for the bump of the sinusoid in between. A cell then counts
+ * at least the votes of any fine bin it holds, a line cannot hide between
+ * two sampled phi. One work-item per pixel of the band, see houghLine for
+ * yOffset.
+ */
+__kernel void houghLineCoarse(	__global const int* restrict img,
+				__global const int* restrict cosinus,
+				__global const int* restrict sinus,
+				int width,
+				int stepPhi,
+				int stepR,
+				int cRDim,
+				int cPhiDim,
+				int phiDim,
+				int rNeg,
+				int curv,
+				__global acc_t* acc,
+				int yOffset){
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+
+	if(img[y * width + x] == 0){
+		return;
+	}
+	y += yOffset;
+
+	for(int pc = 0; pc < cPhiDim; pc++){
+		int first = pc * stepPhi;
+		int last = min(first + stepPhi - 1, phiDim - 1);
+		int rFirst = x * cosinus[first] + y * sinus[first];
+		int rLast = x * cosinus[last] + y * sinus[last];
+		int rcMin = (rNeg + rBin(min(rFirst, rLast))) / stepR;
+		int rcMax = (rNeg + rBin(max(rFirst, rLast) + curv)) / stepR;
+
+		for(int rc = rcMin; rc <= rcMax; rc++){
+			accAdd(acc, cRDim * pc + rc, 1);
+		}
+	}
+}
+
+/**
+ * Second level of the coarse-to-fine hough (-H coarse). Candidate k is a
+ * window of winPhi x winR fine bins from (phi, r) = (cands[2k], cands[2k+1])
+ * around a cell of the coarse accumulator, acc holds the nbCand windows.
+ * An edge pixel only votes in the windows of the lines it is near : its
+ * r at the middle phi of the window within rTol (fixed-point) of the
+ * middle of the window, rTol covers the drift of r over the window.
+ * One work-item per pixel of the band, see houghLine for yOffset.
+ */
+__kernel void houghRefine(	__global const int* restrict img,
+				__global const int* restrict cosinus,
+				__global const int* restrict sinus,
+				int width,
+				__global const int* restrict cands,
+				int nbCand,
+				int winPhi,
+				int winR,
+				int rTol,
+				__global int* acc,
+				int yOffset){
+
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+
+	if(img[y * width + x] == 0){
+		return;
+	}
+	y += yOffset;
+
+	for(int k = 0; k < nbCand; k++){
+		int phi0 = cands[2 * k];
+		int r0 = cands[2 * k + 1];
+		int mid = phi0 + winPhi / 2;
+		int rMid = x * cosinus[mid] + y * sinus[mid];
+		int rCenter = (2 * r0 + winR) * (1 << (HOUGH_FRAC_BITS - 1));
+
+		if(abs(rMid - rCenter) > rTol){
+			continue;
+		}
+
+		for(int i = 0; i < winPhi; i++){
+			int r = rBin(x * cosinus[phi0 + i] + y * sinus[phi0 + i]) - r0;
+
+			if(r >= 0 && r < winR){
+				atomic_inc(&acc[(k * winPhi + i) * winR + r]);
+			}
+		}
+	}
+}
+
+// work-items of a topVotes group and votes of its tile, host side too
+#define TOPK_GROUP 256
+#define TOPK_TILE (16 * TOPK_GROUP)
+
+/**
+ * Non-maximum suppression of the hough space : a bin is a peak if no bin
+ * of its (+- nmsR, +- nmsPhi) window has more votes, or as many with a
+ * lower index so a plateau keeps a single bin. The window is clipped to
+ * the accumulator, not wrapped.
+ */
+bool houghPeak(__global const acc_t* restrict acc, int pos, int v, int rDim,
+		int phiDim, int nmsR, int nmsPhi){
+	int r = pos % rDim;
+	int phi = pos / rDim;
+
+	for(int dp = max(-nmsPhi, -phi); dp <= min(nmsPhi, phiDim - 1 - phi); dp++){
+		for(int dr = max(-nmsR, -r); dr <= min(nmsR, rDim - 1 - r); dr++){
+			int q = pos + dp * rDim + dr;
+			int w = acc[q];
+
+			if(w > v || (w == v && q < pos)){
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Best bin of the work-item lid in a topVotes tile, ties to the first. On
+ * the accumulator (peaks) the best bin must also be a houghPeak : it is
+ * tested only once it beats every other bin of the work-item, a loser is
+ * cleared and the next best tested. Like the heap root of the host top-K,
+ * bins below the k best of the tile never pay the window scan.
+ */
+void tileBest(__local int* tile, int lid, __global const acc_t* restrict acc,
+		bool peaks, int base, int n, int rDim, int nmsR, int nmsPhi,
+		int* bestVotes, int* bestPos){
+	while(true){
+		int myVotes = -1;
+		int myPos = lid;
+		for(int i = lid; i < TOPK_TILE; i += TOPK_GROUP){
+			if(tile[i] > myVotes){
+				myVotes = tile[i];
+				myPos = i;
+			}
+		}
+
+		if(!peaks || myVotes <= 0 || houghPeak(acc, base + myPos, myVotes,
+				rDim, n / rDim, nmsR, nmsPhi)){
+			*bestVotes = myVotes;
+			*bestPos = myPos;
+			return;
+		}
+		tile[myPos] = 0;
+	}
+}
+
+/**
+ * One step of the device top-K of the accumulator. Each work-group loads
+ * a tile of TOPK_TILE votes in local memory and writes its k best (votes,
+ * bin) pairs, best first, ties to the first of the tile. Every work-item
+ * keeps the best of its own bins, a round is a max reduction of those
+ * and only the owner of the winner looks for its next best.
+ * The first step runs on the accumulator (bins NULL : the bin is the
+ * index), the next ones on the pairs of the previous step until a single
+ * group is left. Tiles that run out of votes stop early and pad with
+ * (0, 0) pairs, topLines drops them.
+ * On the accumulator (acc_t counters) only the houghPeak bins compete,
+ * tested lazily by tileBest.
+ */
+__kernel __attribute__((reqd_work_group_size(TOPK_GROUP,1,1)))
+void topVotes(	__global const int* restrict votes,
+		__global const int* restrict bins, // NULL on the accumulator
+		int n,
+		int k,
+		int rDim,
+		int nmsR,
+		int nmsPhi,
+		__global int* restrict outVotes,
+		__global int* restrict outBins){
+
+	__local int tile[TOPK_TILE];
+	__local int bestVotes[TOPK_GROUP];
+	__local int bestPos[TOPK_GROUP];
+
+	int lid = get_local_id(0);
+	int base = get_group_id(0) * TOPK_TILE;
+	int out = get_group_id(0) * k;
+
+	__global const acc_t* acc = (__global const acc_t*) votes;
+
+	bool peaks = bins == NULL;
+
+	// a work-item only reads back its own bins of the tile
+	for(int i = lid; i < TOPK_TILE; i += TOPK_GROUP){
+		tile[i] = base + i >= n ? -1 : (peaks ? acc[base + i]
+			: votes[base + i]);
+	}
+
+	int myVotes, myPos;
+	tileBest(tile, lid, acc, peaks, base, n, rDim, nmsR, nmsPhi,
+		&myVotes, &myPos);
+
+	for(int j = 0; j < k; j++){
+		bestVotes[lid] = myVotes;
+		bestPos[lid] = myPos;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for(int s = TOPK_GROUP / 2; s > 0; s >>= 1){
+			if(lid < s){
+				int v = bestVotes[lid + s];
+				int pos = bestPos[lid + s];
+
+				if(v > bestVotes[lid]
+					|| (v == bestVotes[lid] && pos < bestPos[lid])){
+					bestVotes[lid] = v;
+					bestPos[lid] = pos;
+				}
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		int winVotes = bestVotes[0];
+		int winPos = bestPos[0];
+
+		// same for the whole group, the rest of the tile is empty
+		if(winVotes <= 0){
+			for(int r = j + lid; r < k; r += TOPK_GROUP){
+				outVotes[out + r] = 0;
+				outBins[out + r] = 0;
+			}
+			return;
+		}
+
+		if(lid == 0){
+			outVotes[out + j] = winVotes;
+			outBins[out + j] = bins != NULL ? bins[base + winPos]
+				: base + winPos;
+		}
+
+		if(winPos % TOPK_GROUP == lid){
+			tile[winPos] = -1;
+			tileBest(tile, lid, acc, peaks, base, n, rDim, nmsR, nmsPhi,
+				&myVotes, &myPos);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
@@ -0,0 +1,59 @@
+#include "FrameQueue.h"
+
+void queueInit(FrameQueue* q, int capacity){
+	q->items = (void**)malloc(capacity * sizeof(void*));
+	if(q->items == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
+
+	q->capacity = capacity;
+	q->head = 0;
+	q->count = 0;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->notEmpty, NULL);
+	pthread_cond_init(&q->notFull, NULL);
+}
+
+void queuePush(FrameQueue* q, void* item){
+	pthread_mutex_lock(&q->lock);
+
+	while(q->count == q->capacity){
+		pthread_cond_wait(&q->notFull, &q->lock);
+	}
+
+	q->items[(q->head + q->count) % q->capacity] = item;
+	q->count++;
+
+	pthread_cond_signal(&q->notEmpty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void* queuePop(FrameQueue* q){
+	void* item;
+
+	pthread_mutex_lock(&q->lock);
+
+	while(q->count == 0){
+		pthread_cond_wait(&q->notEmpty, &q->lock);
+	}
+
+	item = q->items[q->head];
+	q->head = (q->head + 1) % q->capacity;
+	q->count--;
+
+	pthread_cond_signal(&q->notFull);
+	pthread_mutex_unlock(&q->lock);
+
+	return item;
+}
+
+void queueDestroy(FrameQueue* q){
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->notEmpty);
+	pthread_cond_destroy(&q->notFull);
+
+	free(q->items);
+	q->items = NULL;
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/**
+ * Bounded blocking FIFO used between the batch stages (decode, openCL,
+ * encode). Push blocks while the queue is full so at most capacity images
+ * are in flight between two stages.
+ */
+typedef struct {
+	void** items;
+	int capacity;
+	int head;
+	int count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+} FrameQueue;
+
+void queueInit(FrameQueue* q, int capacity);
+void queuePush(FrameQueue* q, void* item);
+void* queuePop(FrameQueue* q);
+void queueDestroy(FrameQueue* q);
@@ -1,7 +1,7 @@
 #include "PNGimg.h"
 
-int openImg(int* a_width, int* a_height, png_bytep **rows){
-        printf("Opening img\n");
+int openImg(const char* path, int* a_width, int* a_height, png_bytep **rows){
+        printf("Opening img %s\n", path);
 
         FILE* img = NULL;
         int width;
@@ -10,7 +10,7 @@ int openImg(int* a_width, int* a_height, png_bytep **rows){
         png_byte bit_depth;
         png_bytep *row_pointers;
 
-        img = fopen("./bin/rlc.png", "rb");
+        img = fopen(path, "rb");
 
         if(img == NULL){
                 printf("Error opening image\n");
@@ -62,17 +62,26 @@ int openImg(int* a_width, int* a_height, png_bytep **rows){
 
 // STOP FORMAT
 
+        // one contiguous RGBA block so the image can be uploaded at once,
+        // free rows[0] then rows
+        size_t rowbytes = png_get_rowbytes(png,info);
+        png_bytep pixels = (png_bytep)malloc(rowbytes * height);
         row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
+        if(pixels == NULL || row_pointers == NULL){
+                printf("Out of memory\n");
+                free(pixels);
+                free(row_pointers);
+                fclose(img);
+                png_destroy_read_struct(&png, &info, NULL);
+                return -1;
+        }
         for(int y = 0; y < height; y++) {
-                row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png,info));
+                row_pointers[y] = pixels + y * rowbytes;
         }
 
         png_read_image(png, row_pointers);
 
         printf("W : %d, H : %d\n", width, height);
-	
-	png_bytep row = row_pointers[12];
-	png_bytep px  = &(row[2 * 4]);
 
         fclose(img);
 	img = NULL;
@@ -91,39 +100,6 @@ int openImg(int* a_width, int* a_height, png_bytep **rows){
 	return 0;
 }
 
-int getRGBpixel(int **r, int **g, int **b, int width, int height, png_bytep *rows)
-{
-	int nbPixel = width * height;
-	int datasize = nbPixel * sizeof(int);
-	int *red, *green, *blue;
-	
-	red 	= (int*)malloc(datasize);
-	green 	= (int*)malloc(datasize);
-	blue 	= (int*)malloc(datasize);
-
-	if(red == NULL or green == NULL or blue == NULL){
-		printf("Out of memory");
-		return -1;
-	} 
-	for(int y = 0; y < height; y++){
-		png_bytep row = rows[y];
-		for(int x = 0; x < width; x++){
-			png_bytep px = &(row[x * 4]);
-			red[y * width + x]= px[0];
-			green[y * width + x] = px[1];
-			blue[y * width + x] = px[2];
-		}
-	}	
-
-	*r = red;
-	*g = green;
-	*b = blue;	
-
-	printf("RGB copied\n");
-
-	return 0;
-}
-
 void process(int width, int height, png_bytep *rows, int* grey){
 	for(int y = 0; y < height; y++){
 		png_bytep row = rows[y];
@@ -136,10 +112,10 @@ void process(int width, int height, png_bytep *rows, int* grey){
 	}	
 }
 
-void write_png_file(int width, int height, png_bytep *row_pointers) {
+void write_png_file(const char* path, int width, int height, png_bytep *row_pointers) {
   	int y;
 
-  	FILE *fp = fopen("out.png", "wb");
+  	FILE *fp = fopen(path, "wb");
 	  if(!fp) abort();
 
 	  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -173,13 +149,13 @@ void write_png_file(int width, int height, png_bytep *row_pointers) {
 	  fclose(fp);
 }
 
-void draw_line(	png_bytep *rows, int rDim, int phiDim, int accPos,
+void draw_line(	png_bytep *rows, int rDim, int rNeg, int phiDim, int accPos,
 		float discR, float discPhi, int width, int height ){
 	// accumulator format (r,phi)	
 
-	// Since width of acc is rDim -> Xpos = pos % rDim
+	// Since width of acc is rDim -> Xpos = pos % rDim, r starts at -rNeg
 	// Ypos = pos / rdim -> int / int always floored (if both positive)
-	float r = (accPos % rDim) * discR ;
+	float r = (accPos % rDim - rNeg) * discR ;
 	float phi = (accPos / rDim) * discPhi ;
 
 	int xPixel = (int) ( r * cos( phi ) );
@@ -200,6 +176,9 @@ void draw_line(	png_bytep *rows, int rDim, int phiDim, int accPos,
 	//if(yPixel != 0  ){return;}// uncomment for vertical focus
 
 	if(xPixel == 0){ // horizontal line
+		if(yPixel < 0 || yPixel >= height){ // small negative r
+			return;
+		}
 		for(int i = 0 ; i < width; i++){
 			row = rows[yPixel];
 			pixel =&(row[i * 4]);
@@ -208,6 +187,9 @@ void draw_line(	png_bytep *rows, int rDim, int phiDim, int accPos,
 			pixel[2] = 0;
 		}
 	}else if(yPixel == 0){ // vertical line 
+		if(xPixel < 0 || xPixel >= width){
+			return;
+		}
 		for(int i = 0 ; i < height; i++){
 			row = rows[i];
 			pixel = &(row[xPixel * 4]);
@@ -0,0 +1,800 @@
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "cpuBackend.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_X86
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CPU_NEON
+#endif
+
+/**
+ * Thread pool : workers wait for a new generation, run their static share
+ * [n * id / nb, n * (id + 1) / nb) of the range then report back.
+ * The calling thread runs share 0.
+ */
+typedef void (*CpuTask)(void* arg, int begin, int end);
+
+typedef struct {
+	pthread_t *threads;
+	int nbThreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+
+	CpuTask task;
+	void* arg;
+	int n;
+	int generation;
+	int running;
+	int quit;
+} ThreadPool;
+
+ThreadPool pool;
+int useAVX2 = 0;
+
+void* poolWorker(void* a){
+	int id = (int)(long) a;
+	int seen = 0;
+
+	for(;;){
+		pthread_mutex_lock(&pool.lock);
+		while(pool.generation == seen && !pool.quit){
+			pthread_cond_wait(&pool.start, &pool.lock);
+		}
+		if(pool.quit){
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+		seen = pool.generation;
+		CpuTask task = pool.task;
+		void* arg = pool.arg;
+		int n = pool.n;
+		pthread_mutex_unlock(&pool.lock);
+
+		task(arg, (long) n * id / pool.nbThreads,
+			(long) n * (id + 1) / pool.nbThreads);
+
+		pthread_mutex_lock(&pool.lock);
+		if(--pool.running == 0){
+			pthread_cond_signal(&pool.done);
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+}
+
+void parallelFor(int n, CpuTask task, void* arg){
+	pthread_mutex_lock(&pool.lock);
+	pool.task = task;
+	pool.arg = arg;
+	pool.n = n;
+	pool.running = pool.nbThreads - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	task(arg, 0, (long) n / pool.nbThreads);
+
+	pthread_mutex_lock(&pool.lock);
+	while(pool.running != 0){
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void cpuInit(int nbThreads){
+	if(nbThreads <= 0){
+		nbThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(nbThreads <= 0){
+		nbThreads = 1;
+	}
+
+#ifdef CPU_X86
+	useAVX2 = __builtin_cpu_supports("avx2");
+#endif
+
+	printf("CPU backend : %d threads, %s\n", nbThreads,
+		useAVX2 ? "AVX2" :
+#ifdef CPU_NEON
+		"NEON"
+#else
+		"scalar"
+#endif
+		);
+
+	pool.nbThreads = nbThreads;
+	pool.generation = 0;
+	pool.running = 0;
+	pool.quit = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.start, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	pool.threads = (pthread_t*) malloc(nbThreads * sizeof(pthread_t));
+	for(int i = 1; i < nbThreads; i++){
+		pthread_create(&pool.threads[i], NULL, poolWorker, (void*)(long) i);
+	}
+}
+
+void cpuRelease(){
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	for(int i = 1; i < pool.nbThreads; i++){
+		pthread_join(pool.threads[i], NULL);
+	}
+	free(pool.threads);
+	pool.threads = NULL;
+
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.start);
+	pthread_cond_destroy(&pool.done);
+}
+
+void cpuPipelineInit(CpuPipeline* p, float discStepR, float discStepPhi,
+		int phiDim, int sobelMag, int sobelThreshold){
+	p->width = 0;
+	p->height = 0;
+	p->nb_pixel = 0;
+	p->discStepR = discStepR;
+	p->rDim = 0;
+	p->rNeg = 0;
+	p->phiDim = phiDim;
+	p->accSize = 0;
+	p->sobelMag = sobelMag;
+	p->sobelThreshold = sobelThreshold;
+	p->grey = NULL;
+	p->acc = NULL;
+	p->edgeX = NULL;
+	p->edgeY = NULL;
+	p->nbEdges = 0;
+
+	p->sinus = (int*) malloc(phiDim * sizeof(int));
+	p->cosinus = (int*) malloc(phiDim * sizeof(int));
+
+	if(p->sinus == NULL || p->cosinus == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
+
+	cpuHoughTables(discStepR, discStepPhi, phiDim, p->cosinus, p->sinus);
+}
+
+/**
+ * cos and sin of every phi bin in fixed-point (HOUGH_FRAC_BITS), already
+ * divided by discStepR : the r bin of a vote is x * cos + y * sin without
+ * divide. The device tables come from here too, both backends cast the
+ * same votes.
+ */
+void cpuHoughTables(float discStepR, float discStepPhi, int phiDim,
+		int* cosinus, int* sinus){
+	float scale = (1 << HOUGH_FRAC_BITS) / discStepR;
+
+	for(int phi = 0 ; phi < phiDim ; phi++){
+		float phiFloat = phi * discStepPhi;
+
+		sinus[phi] = (int) lround(sin(phiFloat) * scale);
+		cosinus[phi] = (int) lround(cos(phiFloat) * scale);
+	}
+}
+
+void cpuPipelineResize(CpuPipeline* p, int width, int height, int rDim,
+		int rNeg){
+	if(p->width == width && p->height == height){
+		return;
+	}
+
+	free(p->grey);
+	free(p->acc);
+	free(p->edgeX);
+	free(p->edgeY);
+
+	p->width = width;
+	p->height = height;
+	p->nb_pixel = width * height;
+	p->rDim = rDim;
+	p->rNeg = rNeg;
+	p->accSize = p->phiDim * rDim;
+
+	// fixed-point r are 32 bits as in the kernels
+	if(sqrt((double) width * width + (double) height * height)
+		/ p->discStepR >= (1u << (31 - HOUGH_FRAC_BITS)) - 1){
+		printf("Image too large for the fixed-point hough\n");
+		exit(1);
+	}
+
+	p->grey = (unsigned char*) malloc(p->nb_pixel);
+	p->acc = (int*) malloc(p->accSize * sizeof(int));
+	p->edgeX = (int*) malloc(p->nb_pixel * sizeof(int));
+	p->edgeY = (int*) malloc(p->nb_pixel * sizeof(int));
+
+	if(p->grey == NULL || p->acc == NULL || p->edgeX == NULL ||
+	   p->edgeY == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
+}
+
+void cpuPipelineRelease(CpuPipeline* p){
+	free(p->grey);
+	free(p->acc);
+	free(p->edgeX);
+	free(p->edgeY);
+	free(p->sinus);
+	free(p->cosinus);
+
+	p->grey = NULL;
+	p->acc = NULL;
+	p->edgeX = NULL;
+	p->edgeY = NULL;
+	p->sinus = NULL;
+	p->cosinus = NULL;
+	p->width = 0;
+	p->height = 0;
+}
+
+// GREY SHADE
+
+typedef struct {
+	const unsigned char* rgba;
+	unsigned char* grey;
+} GreyArgs;
+
+void greyScalar(const unsigned char* rgba, unsigned char* grey,
+		int begin, int end){
+	for(int i = begin; i < end; i++){
+		const unsigned char* px = &rgba[i * 4];
+		grey[i] = (px[0] + px[1] + px[2]) / 3;
+	}
+}
+
+#ifdef CPU_X86
+// 8 pixels per step, s / 3 == (s * 43691) >> 17 for s <= 765
+__attribute__((target("avx2")))
+int greyAVX2(const unsigned char* rgba, unsigned char* grey, int begin, int end){
+	const __m256i mask = _mm256_set1_epi32(0xFF);
+	const __m256i third = _mm256_set1_epi32(43691);
+	int i = begin;
+
+	for(; i + 8 <= end; i += 8){
+		__m256i px = _mm256_loadu_si256((const __m256i*) &rgba[i * 4]);
+		__m256i sum = _mm256_add_epi32(
+			_mm256_add_epi32(_mm256_and_si256(px, mask),
+				_mm256_and_si256(_mm256_srli_epi32(px, 8), mask)),
+			_mm256_and_si256(_mm256_srli_epi32(px, 16), mask));
+		__m256i q = _mm256_srli_epi32(_mm256_mullo_epi32(sum, third), 17);
+
+		// 32 -> 8 bits, each 128 bits lane holds 4 results
+		q = _mm256_packus_epi32(q, q);
+		q = _mm256_packus_epi16(q, q);
+		int lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(q));
+		int hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(q, 1));
+		memcpy(&grey[i], &lo, 4);
+		memcpy(&grey[i + 4], &hi, 4);
+	}
+	return i;
+}
+#endif
+
+void greyTask(void* a, int begin, int end){
+	GreyArgs* args = (GreyArgs*) a;
+	int i = begin;
+
+#ifdef CPU_X86
+	if(useAVX2){
+		i = greyAVX2(args->rgba, args->grey, begin, end);
+	}
+#elif defined(CPU_NEON)
+	const uint16x8_t third = vdupq_n_u16(43691);
+	for(; i + 8 <= end; i += 8){
+		uint8x8x4_t px = vld4_u8(&args->rgba[i * 4]);
+		uint16x8_t sum = vaddw_u8(vaddl_u8(px.val[0], px.val[1]), px.val[2]);
+		uint32x4_t lo = vmull_u16(vget_low_u16(sum), vget_low_u16(third));
+		uint32x4_t hi = vmull_u16(vget_high_u16(sum), vget_high_u16(third));
+		uint16x8_t q = vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16));
+		vst1_u8(&args->grey[i], vshrn_n_u16(q, 1));
+	}
+#endif
+	greyScalar(args->rgba, args->grey, i, end);
+}
+
+void cpuGreyShade(CpuPipeline* p, const unsigned char* rgba){
+	GreyArgs args = {rgba, p->grey};
+	parallelFor(p->nb_pixel, greyTask, &args);
+}
+
+// SOBEL
+
+typedef struct {
+	const unsigned char* img;
+	int* sobel;
+	int w;
+	int h;
+	int mag;
+	int threshold;
+} SobelArgs;
+
+// gradMagnitude of the kernel
+int sobelMagnitude(int gradX, int gradY, int mag){
+	int a = abs(gradX);
+	int b = abs(gradY);
+
+	switch(mag){
+		case SOBEL_MAG_L1: return a + b;
+		case SOBEL_MAG_L2: return (int) sqrtf((float) (a * a + b * b));
+		case SOBEL_MAG_L2_FAST:
+			return (a > b ? a : b) + ((3 * (a < b ? a : b)) >> 3);
+		default: return gradX + gradY;
+	}
+}
+
+int sobelPixel(const unsigned char* img, int id, int w, int mag,
+		int threshold){
+	int gradX = - img[id - w -1] - 2 * img[id -1] - img[id + w -1]
+		+ img[id - w +1] + 2 * img[id +1] + img[id + w +1];
+
+	int gradY = - img[id - w -1] - 2 * img[id -w] - img[id - w +1]
+		+ img[id + w -1] + 2 * img[id +w] + img[id + w +1];
+
+	int grad = sobelMagnitude(gradX, gradY, mag);
+
+	if(grad < threshold){
+		return 0;
+	}else if(grad > 255){
+		return 255;
+	}
+	return grad;
+}
+
+#ifdef CPU_X86
+// 16 pixels of row y per step from x, returns the first x not done.
+// SOBEL_MAG_L2 is left to sobelPixel
+__attribute__((target("avx2")))
+int sobelRowAVX2(const unsigned char* img, int* out, int y, int w, int mag,
+		int threshold){
+	const __m256i low = _mm256_set1_epi16(threshold);
+	const __m256i high = _mm256_set1_epi16(255);
+	int x = 1;
+
+	for(; x + 16 <= w - 1; x += 16){
+		const unsigned char* r0 = &img[(y - 1) * w + x];
+		const unsigned char* r1 = &img[y * w + x];
+		const unsigned char* r2 = &img[(y + 1) * w + x];
+
+		#define LOAD16(ptr) _mm256_cvtepu8_epi16( \
+			_mm_loadu_si128((const __m128i*)(ptr)))
+		__m256i a0 = LOAD16(r0 - 1), b0 = LOAD16(r0), c0 = LOAD16(r0 + 1);
+		__m256i a1 = LOAD16(r1 - 1), c1 = LOAD16(r1 + 1);
+		__m256i a2 = LOAD16(r2 - 1), b2 = LOAD16(r2), c2 = LOAD16(r2 + 1);
+		#undef LOAD16
+
+		// gradX = (c0 - a0) + 2 (c1 - a1) + (c2 - a2)
+		__m256i gx = _mm256_add_epi16(
+			_mm256_add_epi16(_mm256_sub_epi16(c0, a0),
+				_mm256_sub_epi16(c2, a2)),
+			_mm256_slli_epi16(_mm256_sub_epi16(c1, a1), 1));
+		// gradY = (a2 + 2 b2 + c2) - (a0 + 2 b0 + c0)
+		__m256i gy = _mm256_sub_epi16(
+			_mm256_add_epi16(_mm256_add_epi16(a2, c2),
+				_mm256_slli_epi16(b2, 1)),
+			_mm256_add_epi16(_mm256_add_epi16(a0, c0),
+				_mm256_slli_epi16(b0, 1)));
+
+		__m256i grad;
+		if(mag == SOBEL_MAG_SUM){
+			grad = _mm256_add_epi16(gx, gy);
+		}else{
+			__m256i a = _mm256_abs_epi16(gx);
+			__m256i b = _mm256_abs_epi16(gy);
+			grad = mag == SOBEL_MAG_L1 ? _mm256_add_epi16(a, b)
+				: _mm256_add_epi16(_mm256_max_epi16(a, b), _mm256_srai_epi16(
+				_mm256_mullo_epi16(_mm256_min_epi16(a, b),
+				_mm256_set1_epi16(3)), 3));
+		}
+		__m256i keep = _mm256_cmpgt_epi16(low, grad); // grad < threshold
+		grad = _mm256_andnot_si256(keep, _mm256_min_epi16(grad, high));
+
+		_mm256_storeu_si256((__m256i*) &out[y * w + x],
+			_mm256_cvtepi16_epi32(_mm256_castsi256_si128(grad)));
+		_mm256_storeu_si256((__m256i*) &out[y * w + x + 8],
+			_mm256_cvtepi16_epi32(_mm256_extracti128_si256(grad, 1)));
+	}
+	return x;
+}
+#endif
+
+#ifdef CPU_NEON
+// 8 pixels of row y per step from x, returns the first x not done.
+// SOBEL_MAG_L2 is left to sobelPixel
+int sobelRowNEON(const unsigned char* img, int* out, int y, int w, int mag,
+		int threshold){
+	const int16x8_t low = vdupq_n_s16(threshold);
+	const int16x8_t high = vdupq_n_s16(255);
+	int x = 1;
+
+	for(; x + 8 <= w - 1; x += 8){
+		const unsigned char* r0 = &img[(y - 1) * w + x];
+		const unsigned char* r1 = &img[y * w + x];
+		const unsigned char* r2 = &img[(y + 1) * w + x];
+
+		#define LOAD8(ptr) vreinterpretq_s16_u16(vmovl_u8(vld1_u8(ptr)))
+		int16x8_t a0 = LOAD8(r0 - 1), b0 = LOAD8(r0), c0 = LOAD8(r0 + 1);
+		int16x8_t a1 = LOAD8(r1 - 1), c1 = LOAD8(r1 + 1);
+		int16x8_t a2 = LOAD8(r2 - 1), b2 = LOAD8(r2), c2 = LOAD8(r2 + 1);
+		#undef LOAD8
+
+		int16x8_t gx = vaddq_s16(vaddq_s16(vsubq_s16(c0, a0),
+				vsubq_s16(c2, a2)), vshlq_n_s16(vsubq_s16(c1, a1), 1));
+		int16x8_t gy = vsubq_s16(
+			vaddq_s16(vaddq_s16(a2, c2), vshlq_n_s16(b2, 1)),
+			vaddq_s16(vaddq_s16(a0, c0), vshlq_n_s16(b0, 1)));
+
+		int16x8_t grad;
+		if(mag == SOBEL_MAG_SUM){
+			grad = vaddq_s16(gx, gy);
+		}else{
+			int16x8_t a = vabsq_s16(gx);
+			int16x8_t b = vabsq_s16(gy);
+			grad = mag == SOBEL_MAG_L1 ? vaddq_s16(a, b)
+				: vaddq_s16(vmaxq_s16(a, b),
+				vshrq_n_s16(vmulq_n_s16(vminq_s16(a, b), 3), 3));
+		}
+		uint16x8_t keep = vcltq_s16(grad, low);
+		grad = vbicq_s16(vminq_s16(grad, high), vreinterpretq_s16_u16(keep));
+
+		vst1q_s32(&out[y * w + x], vmovl_s16(vget_low_s16(grad)));
+		vst1q_s32(&out[y * w + x + 4], vmovl_s16(vget_high_s16(grad)));
+	}
+	return x;
+}
+#endif
+
+// rows [begin, end) of the image
+void sobelTask(void* a, int begin, int end){
+	SobelArgs* args = (SobelArgs*) a;
+	int w = args->w;
+
+	for(int y = begin; y < end; y++){
+		int* out = &args->sobel[y * w];
+
+		// no edge on the sides
+		if(y == 0 || y == args->h - 1){
+			memset(out, 0, w * sizeof(int));
+			continue;
+		}
+		out[0] = 0;
+		out[w - 1] = 0;
+
+		int x = 1;
+#ifdef CPU_X86
+		if(useAVX2 && args->mag != SOBEL_MAG_L2){
+			x = sobelRowAVX2(args->img, args->sobel, y, w, args->mag,
+				args->threshold);
+		}
+#elif defined(CPU_NEON)
+		if(args->mag != SOBEL_MAG_L2){
+			x = sobelRowNEON(args->img, args->sobel, y, w, args->mag,
+				args->threshold);
+		}
+#endif
+		for(; x < w - 1; x++){
+			out[x] = sobelPixel(args->img, y * w + x, w, args->mag,
+				args->threshold);
+		}
+	}
+}
+
+void cpuSobel(CpuPipeline* p, int* edges){
+	SobelArgs args = {p->grey, edges, p->width, p->height, p->sobelMag,
+		p->sobelThreshold};
+	parallelFor(p->height, sobelTask, &args);
+}
+
+// HOUGH
+
+/**
+ * Threads own a range of phi and vote with every edge pixel, no two threads
+ * write the same bin so no atomics are needed. Rows start at r = -rNeg
+ * like in the kernel, negative r stay in the row of their phi.
+ * r is x * cos + y * sin on the fixed-point tables, binned as rBin of the
+ * kernel : the votes are the device ones bit for bit.
+ */
+typedef struct {
+	CpuPipeline* p;
+} HoughArgs;
+
+// r bin of a fixed-point r, truncated toward 0 as rBin in the kernel
+inline int houghBin(int rFixed){
+	return rFixed >= 0 ? rFixed >> HOUGH_FRAC_BITS
+		: -(-rFixed >> HOUGH_FRAC_BITS);
+}
+
+void houghScalar(CpuPipeline* p, int* row, int c, int s, int begin){
+	for(int i = begin; i < p->nbEdges; i++){
+		row[houghBin(p->edgeX[i] * c + p->edgeY[i] * s)] += 1;
+	}
+}
+
+#ifdef CPU_X86
+// r of 8 edges per step, the increments themselves stay scalar
+__attribute__((target("avx2")))
+int houghAVX2(CpuPipeline* p, int* row, int c, int s){
+	const __m256i vc = _mm256_set1_epi32(c);
+	const __m256i vs = _mm256_set1_epi32(s);
+	int r[8];
+	int i = 0;
+
+	for(; i + 8 <= p->nbEdges; i += 8){
+		__m256i rFixed = _mm256_add_epi32(
+			_mm256_mullo_epi32(
+				_mm256_loadu_si256((const __m256i*) &p->edgeX[i]), vc),
+			_mm256_mullo_epi32(
+				_mm256_loadu_si256((const __m256i*) &p->edgeY[i]), vs));
+		// shift |r| and give the sign back, truncation toward 0
+		__m256i bin = _mm256_sign_epi32(_mm256_srli_epi32(
+			_mm256_abs_epi32(rFixed), HOUGH_FRAC_BITS), rFixed);
+		_mm256_storeu_si256((__m256i*) r, bin);
+
+		for(int k = 0; k < 8; k++){
+			row[r[k]] += 1;
+		}
+	}
+	return i;
+}
+#endif
+
+#ifdef CPU_NEON
+int houghNEON(CpuPipeline* p, int* row, int c, int s){
+	const int32x4_t vc = vdupq_n_s32(c);
+	const int32x4_t vs = vdupq_n_s32(s);
+	int r[4];
+	int i = 0;
+
+	for(; i + 4 <= p->nbEdges; i += 4){
+		int32x4_t rFixed = vmlaq_s32(vmulq_s32(vld1q_s32(&p->edgeX[i]), vc),
+			vld1q_s32(&p->edgeY[i]), vs);
+		int32x4_t bin = vshrq_n_s32(vabsq_s32(rFixed), HOUGH_FRAC_BITS);
+		bin = vbslq_s32(vcltq_s32(rFixed, vdupq_n_s32(0)), vnegq_s32(bin),
+			bin);
+		vst1q_s32(r, bin);
+
+		for(int k = 0; k < 4; k++){
+			row[r[k]] += 1;
+		}
+	}
+	return i;
+}
+#endif
+
+void houghTask(void* a, int begin, int end){
+	CpuPipeline* p = ((HoughArgs*) a)->p;
+
+	for(int phi = begin; phi < end; phi++){
+		int* row = &p->acc[p->rDim * phi + p->rNeg];
+		int c = p->cosinus[phi];
+		int s = p->sinus[phi];
+		int i = 0;
+
+#ifdef CPU_X86
+		if(useAVX2){
+			i = houghAVX2(p, row, c, s);
+		}
+#elif defined(CPU_NEON)
+		i = houghNEON(p, row, c, s);
+#endif
+		houghScalar(p, row, c, s, i);
+	}
+}
+
+void cpuHoughLine(CpuPipeline* p, const int* edges){
+	// gather the edge pixels once, every phi reuses them
+	p->nbEdges = 0;
+	for(int y = 0; y < p->height; y++){
+		for(int x = 0; x < p->width; x++){
+			if(edges[y * p->width + x] != 0){
+				p->edgeX[p->nbEdges] = x;
+				p->edgeY[p->nbEdges] = y;
+				p->nbEdges++;
+			}
+		}
+	}
+
+	memset(p->acc, 0, p->accSize * sizeof(int));
+
+	HoughArgs args = {p};
+	parallelFor(p->phiDim, houghTask, &args);
+}
+
+// TOP-K
+
+/**
+ * k best bins of an accumulator, for findLine on both backends. Each
+ * thread scans its range with its own min-heap of the k best bins so far,
+ * a bin only enters if it beats the root (a SIMD compare skips 8 bins at
+ * once). The heaps are then merged in range order. O(accSize + insertions
+ * * log k) instead of a k long bubbling per insertion.
+ * A bin beating the root must also be the peak of its (+- nmsR, +- nmsPhi)
+ * window, the same test as houghPeak in the kernel.
+ * Returns how many bins with votes were found, ids has that many.
+ */
+typedef struct {
+	const int* acc;
+	int accSize;
+	int rDim;
+	int phiDim;
+	int nmsR;
+	int nmsPhi;
+	int k;
+	int nbChunks;
+	int* scores; // one heap of k per chunk
+	int* ids;
+} TopKArgs;
+
+// heap order : fewer votes first, then the later bin, ties keep the first
+inline bool heapLess(int scoreA, int idA, int scoreB, int idB){
+	return scoreA < scoreB || (scoreA == scoreB && idA > idB);
+}
+
+// ties to the lower index so a plateau keeps one bin, window clipped
+bool houghPeak(const TopKArgs* args, int pos, int v){
+	int r = pos % args->rDim;
+	int phi = pos / args->rDim;
+	int dpMin = phi < args->nmsPhi ? -phi : -args->nmsPhi;
+	int dpMax = args->phiDim - 1 - phi < args->nmsPhi ?
+		args->phiDim - 1 - phi : args->nmsPhi;
+	int drMin = r < args->nmsR ? -r : -args->nmsR;
+	int drMax = args->rDim - 1 - r < args->nmsR ?
+		args->rDim - 1 - r : args->nmsR;
+
+	for(int dp = dpMin; dp <= dpMax; dp++){
+		for(int dr = drMin; dr <= drMax; dr++){
+			int q = pos + dp * args->rDim + dr;
+			int w = args->acc[q];
+
+			if(w > v || (w == v && q < pos)){
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// replaces the root of a heap of n bins and sifts it down
+void heapReplace(int* score, int* id, int n, int s, int i){
+	int pos = 0;
+
+	for(;;){
+		int child = 2 * pos + 1;
+		if(child >= n){
+			break;
+		}
+		if(child + 1 < n && heapLess(score[child + 1], id[child + 1],
+			score[child], id[child])){
+			child++;
+		}
+		if(!heapLess(score[child], id[child], s, i)){
+			break;
+		}
+		score[pos] = score[child];
+		id[pos] = id[child];
+		pos = child;
+	}
+	score[pos] = s;
+	id[pos] = i;
+}
+
+void topKScalar(const TopKArgs* args, int begin, int end, int* score,
+		int* id){
+	const int* acc = args->acc;
+
+	for(int i = begin; i < end; i++){
+		if(acc[i] > score[0] && houghPeak(args, i, acc[i])){
+			heapReplace(score, id, args->k, acc[i], i);
+		}
+	}
+}
+
+#ifdef CPU_X86
+__attribute__((target("avx2")))
+int topKAVX2(const TopKArgs* args, int begin, int end, int* score,
+		int* id){
+	int i = begin;
+
+	for(; i + 8 <= end; i += 8){
+		__m256i v = _mm256_loadu_si256((const __m256i*) &args->acc[i]);
+		__m256i gt = _mm256_cmpgt_epi32(v, _mm256_set1_epi32(score[0]));
+
+		if(_mm256_movemask_epi8(gt) != 0){
+			topKScalar(args, i, i + 8, score, id);
+		}
+	}
+	return i;
+}
+#endif
+
+void topKTask(void* a, int begin, int end){
+	TopKArgs* args = (TopKArgs*) a;
+
+	for(int c = begin; c < end; c++){
+		int* score = args->scores + (size_t) c * args->k;
+		int* id = args->ids + (size_t) c * args->k;
+		int from = (long) args->accSize * c / args->nbChunks;
+		int to = (long) args->accSize * (c + 1) / args->nbChunks;
+		int i = from;
+
+		// empty bins never enter, as in the former findLine
+		memset(score, 0, args->k * sizeof(int));
+		memset(id, 0, args->k * sizeof(int));
+
+#ifdef CPU_X86
+		if(useAVX2){
+			i = topKAVX2(args, from, to, score, id);
+		}
+#elif defined(CPU_NEON) && defined(__aarch64__)
+		for(; i + 4 <= to; i += 4){
+			uint32x4_t gt = vcgtq_s32(vld1q_s32(&args->acc[i]),
+				vdupq_n_s32(score[0]));
+
+			if(vmaxvq_u32(gt) != 0){
+				topKScalar(args, i, i + 4, score, id);
+			}
+		}
+#endif
+		topKScalar(args, i, to, score, id);
+	}
+}
+
+int cpuTopK(const int* acc, int rDim, int phiDim, int k, int nmsR,
+		int nmsPhi, int* ids){
+	TopKArgs args;
+	args.acc = acc;
+	args.accSize = rDim * phiDim;
+	args.rDim = rDim;
+	args.phiDim = phiDim;
+	args.nmsR = nmsR;
+	args.nmsPhi = nmsPhi;
+	args.k = k;
+	args.nbChunks = pool.nbThreads;
+	args.scores = (int*) malloc((size_t) args.nbChunks * k * sizeof(int));
+	args.ids = (int*) malloc((size_t) args.nbChunks * k * sizeof(int));
+
+	if(args.scores == NULL || args.ids == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
+
+	parallelFor(args.nbChunks, topKTask, &args);
+
+	// merged in the heap of the first chunk
+	int* score = args.scores;
+	int* id = args.ids;
+	for(int j = k; j < args.nbChunks * k; j++){
+		if(heapLess(score[0], id[0], args.scores[j], args.ids[j])){
+			heapReplace(score, id, k, args.scores[j], args.ids[j]);
+		}
+	}
+
+	// worst first, the root is popped k times. The (0, 0) seeds left when
+	// fewer than k peaks have votes are not lines
+	int nb = 0;
+	for(int j = 0; j < k; j++){
+		int n = k - j;
+
+		if(score[0] > 0){
+			ids[nb++] = id[0];
+		}
+		heapReplace(score, id, n - 1, score[n - 1], id[n - 1]);
+	}
+
+	free(args.scores);
+	free(args.ids);
+	return nb;
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// gradient magnitude of the sobel kernels (-DSOBEL_MAG, host -m), see kernel
+#define SOBEL_MAG_SUM 0	// gradX + gradY, the kernel default
+#define SOBEL_MAG_L1 1
+#define SOBEL_MAG_L2 2
+#define SOBEL_MAG_L2_FAST 3
+#define SOBEL_THRESHOLD 150 // kernel default of -DSOBEL_THRESHOLD (-t)
+#define HOUGH_FRAC_BITS 16 // fixed-point cos / sin tables, see kernel
+
+/**
+ * Native backend for hosts without openCL runtime. Same semantics as the
+ * grey_shade, sobel and houghLine kernels, work is split over a pool of
+ * threads and vectorized with AVX2 (chosen at runtime) or NEON.
+ */
+typedef struct {
+	// image geometry
+	int width;
+	int height;
+	int nb_pixel;
+
+	// accumulator geometry, computed by the caller
+	float discStepR;
+	int rDim;
+	int rNeg; // r is stored at rNeg + r as in the kernels
+	int phiDim;
+	int accSize;
+
+	// sobel specialisation, the -m / -t of the kernels
+	int sobelMag;
+	int sobelThreshold;
+
+	// fixed-point tables of the kernels, see cpuHoughTables
+	int *sinus;
+	int *cosinus;
+
+	unsigned char *grey;
+	int *acc;
+
+	// edge pixels coordinates, gathered before voting
+	int *edgeX;
+	int *edgeY;
+	int nbEdges;
+} CpuPipeline;
+
+void cpuInit(int nbThreads);
+void cpuRelease();
+void cpuPipelineInit(CpuPipeline* p, float discStepR, float discStepPhi,
+		int phiDim, int sobelMag, int sobelThreshold);
+void cpuPipelineResize(CpuPipeline* p, int width, int height, int rDim,
+		int rNeg);
+void cpuPipelineRelease(CpuPipeline* p);
+void cpuGreyShade(CpuPipeline* p, const unsigned char* rgba);
+void cpuSobel(CpuPipeline* p, int* edges);
+void cpuHoughTables(float discStepR, float discStepPhi, int phiDim,
+		int* cosinus, int* sinus);
+void cpuHoughLine(CpuPipeline* p, const int* edges);
+int cpuTopK(const int* acc, int rDim, int phiDim, int k, int nmsR,
+		int nmsPhi, int* ids);
@@ -4,51 +4,313 @@
 #include <png.h>
 #include <time.h>
 #include <sys/time.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "CL/opencl.h"
 #include "PNGimg.h"
+#include "FrameQueue.h"
+#include "cpuBackend.h"
 
 #define NB_LINES 100 
 #define DISCRETE_PHI 0.0033
 #define DISCRETE_R 0.33
+#define BATCH_QUEUE_SIZE 2 // images in flight between two batch stages
+#define MAX_DEVICES 8 // openCL devices sharing one image
+#define MAX_PROF_EVENTS (24 * MAX_DEVICES) // profiled commands per image
+#define HOUGH_TILE 16 // pixels per side of a hough work-group, see kernel
+#define HOUGH_PHI_BAND 32 // max phi per local accumulator slice
+#define HOUGH_PHI_WIN 24 // oriented hough votes for +- bins around the normal
+#define HOUGH_NMS_R 8 // +- r bins a line peak suppresses (-N)
+#define HOUGH_NMS_PHI 8 // +- phi bins a line peak suppresses
+#define HOUGH_COARSE_PHI 3 // fine phi bins of a coarse cell (-H coarse)
+#define HOUGH_COARSE_R 10 // fine r bins of a coarse cell
+#define HOUGH_REFINE_CELLS 2 // +- coarse cells refined around a coarse peak
+#define SOBEL_TILE 16 // pixels per side of a sobelTiled / greySobel group
+#define SOBEL_VEC 8 // pixels of a row per sobelSeparable work-item
+#define SOBEL_SWI_WIDTH 2048 // widest image for the sobelSWI line buffer
+#define COMPACT_GROUP 256 // work-items of a compactEdges group, see kernel
+#define HOUGH_LIST_ITEMS 16384 // work-items walking the edge list (-c)
+#define TOPK_GROUP 256 // work-items of a topVotes group, see kernel
+#define TOPK_TILE (16 * TOPK_GROUP) // votes per topVotes group
+#define CANNY_HYST_PASSES 8 // hysteresis passes of the canny edges
+#define CANNY_HALO (4 + CANNY_HYST_PASSES) // stencil reach + one row a pass
+
+// where the openCL program comes from
+#define PROGRAM_AOCX 0		// offline compiled bin/kernel.aocx (FPGA)
+#define PROGRAM_SOURCE 1	// device/kernel.cl built at runtime, cached
+#define PROGRAM_CACHE_DIR "bin/cache"
+
+// where the grey, sobel and hough stages run
+#define BACKEND_OPENCL 0
+#define BACKEND_CPU 1	// native threads + SIMD, no openCL runtime needed
+
+// houghLine kernel variants
+#define HOUGH_NDRANGE 0	// tiled NDRange with local accumulator slices
+#define HOUGH_SWI 1	// single work-item pipelined sweep (FPGA)
+#define HOUGH_ORIENTED 2 // votes only around the sobel gradient direction
+#define HOUGH_COARSE 3	// coarse accumulator, houghRefine around its peaks
+
+// sobel kernel variants
+#define SOBEL_BASIC 0	// 1D NDRange, neighbours read from global memory
+#define SOBEL_TILED 1	// 2D NDRange, tile + halo staged in local memory
+#define SOBEL_SEPARABLE 2 // vertical then horizontal 1D pass, vload16 rows
+#define SOBEL_FUSED 3	// tiled sobel reading RGBA, grey_shade is skipped
+#define SOBEL_SWI 4	// single work-item line buffer stream (FPGA)
+#define NB_SOBEL_MODES 5
+
+// edge detectors feeding hough
+#define EDGE_SOBEL 0	// thresholded sobel, variant from sobelMode
+#define EDGE_CANNY 1	// blur, gradient, non-maximum suppression, hysteresis
+
+// one profiled enqueue, timestamps are read once the image is done.
+// Stages of the CPU backend have no event and give their times directly.
+typedef struct {
+	const char* name;
+	const char* type; // "kernel" or "transfer"
+	int dev; // index of the device (band) running it
+	cl_event ev;
+	cl_ulong t[4]; // queued, submit, start, end (ns)
+} ProfEvent;
+
+/**
+ * Rows [y0, y0 + rows) of the image, handled by one device. Its buffers
+ * also hold the row above and below (halo) when they exist so sobel sees
+ * every neighbour, sobel writes 0 on the first and last buffer rows so
+ * the halos never vote. canny needs CANNY_HALO rows and clears them
+ * itself. Each band has its own partial accumulator.
+ */
+typedef struct {
+	cl_command_queue queue;
+
+	int y0;
+	int rows;
+	int haloTop;	// halo rows above y0, 0 on the image top
+	int yOffset;	// image row of the first buffer row (y0 - haloTop)
+	int bufRows;	// owned and halo rows
+	int totPx;	// pixels in the buffers
+
+	// one set of kernels per band, their args differ
+	cl_kernel greyKer;
+	cl_kernel sobelKer;
+	cl_kernel sobelTiledKer;
+	cl_kernel sobelSepKer;
+	cl_kernel greySobelKer;
+	cl_kernel sobelSwiKer;
+	cl_kernel houghKer;
+	cl_kernel houghSwiKer;
+	cl_kernel houghOrientKer;
+	cl_kernel clearKer;
+	cl_kernel compactKer;
+	cl_kernel clearCountKer;
+	cl_kernel houghListKer;
+	cl_kernel houghOrientListKer;
+	cl_kernel cannyBlurKer;
+	cl_kernel cannyGradKer;
+	cl_kernel cannyNmsKer;
+	cl_kernel cannyHystKer;
+	cl_kernel cannyEdgesKer;
+	cl_kernel topKer;
+	cl_kernel coarseKer;
+	cl_kernel refineKer;
+	cl_kernel clearRefineKer;
+
+	cl_mem rgba;
+	cl_mem grey;
+	cl_mem edges;
+	cl_mem dirs; // phi of the edge normals, HOUGH_ORIENTED only
+	cl_mem acc;
+
+	// canny intermediates, EDGE_CANNY only
+	cl_mem blur;
+	cl_mem mag;
+	cl_mem sector;
+	cl_mem state;
+
+	// compacted edges (-c) : (y << 16) | x in buffer rows and their value
+	cl_mem edgeList;
+	cl_mem edgeVals;
+	cl_mem edgeCount;
+	int nbEdges; // host copy of edgeCount
+	unsigned int* listHost;
+	unsigned char* valsHost;
+
+	// (votes, bin) pairs of the device top-K, ping-pong between its steps
+	cl_mem topVotes[2];
+	cl_mem topBins[2];
+
+	// HOUGH_COARSE : windows refined around the coarse peaks, their votes
+	cl_mem cand;
+	cl_mem refineAcc;
+} Band;
+
+/**
+ * Persistent openCL pipeline : kernels and tables are created once,
+ * buffers and kernel args are only rebuilt when the image size changes.
+ */
+typedef struct {
+	// image geometry
+	int width;
+	int height;
+	size_t nb_pixel;
+	size_t data_size; // int image
+
+	// accumulator geometry
+	float discStepR;
+	float discStepPhi;
+	int rDim;
+	int phiDim;
+	int accSize;
+	int rNeg; // bins of negative r (phi > pi/2), r is stored at rNeg + r
+	int accBytes; // bytes of a counter, 2 with -a 16 (-DHOUGH_ACC16)
+	int accWords; // ints of an accumulator buffer, cleared by clear_buffer
+
+	// local accumulator slice of the hough kernel : phiBand x win bins
+	int phiBand;
+	int win;
+
+	int houghMode; // HOUGH_NDRANGE, HOUGH_SWI, HOUGH_ORIENTED or HOUGH_COARSE
+	int phiWin; // HOUGH_ORIENTED : votes for phi in [dir - phiWin, dir + phiWin]
+	int sobelMode; // SOBEL_BASIC, _TILED, _SEPARABLE, _FUSED or _SWI
+	bool compact; // hough and read back work on the compacted edge list
+	int edgeMode; // EDGE_SOBEL or EDGE_CANNY
+
+	// tables shared by every device of the context, fixed-point
+	// (HOUGH_FRAC_BITS) and already divided by discStepR
+	cl_mem sinBuf;
+	cl_mem cosBuf;
+
+	// HOUGH_COARSE : houghLineCoarse votes in cells of HOUGH_COARSE_PHI x
+	// HOUGH_COARSE_R fine bins, acc and accSize are this coarse accumulator
+	// and the fine one is never allocated. See houghCoarse.
+	int cRDim;
+	int cPhiDim;
+	int curv; // fixed-point, see houghLineCoarse
+	int nbCand; // coarse peaks refined
+	int winPhi; // fine bins of a refined window : the cells around a peak
+	int winR; // and the NMS window around them
+	int rTol; // fixed-point, see houghRefine
+
+	// image split in row bands, one per device
+	Band bands[MAX_DEVICES];
+	int nbBands;
+	unsigned char* partAcc; // counters read back from the bands, see houghLine
+} Pipeline;
+
+// one image going through the batch stages
+typedef struct {
+	const char* inPath;
+	const char* outPath;
+	int width;
+	int height;
+	png_bytep *rows;
+	int *sobel;
+	int *lineIDs;
+	int nbLines; // lines found, at most NB_LINES
+	int rDim;
+	int rNeg;
+	int phiDim;
+} Frame;
+
+typedef struct {
+	char** inPaths;
+	char** outPaths;
+	int nbImg;
+	FrameQueue decoded;	// decode thread -> openCL
+	FrameQueue computed;	// openCL -> encode thread
+} Batch;
 
 // prototype
 bool init();
 void cleanup();
 cl_platform_id findPlatform(const char *platformName);
-cl_device_id findDevices(cl_platform_id pid);
-cl_context createContext(cl_device_id dID);
+void findDevices(cl_platform_id pid, cl_device_id* dIDs, cl_uint n);
+void listDevices();
+const char* deviceTypeName(cl_device_type type);
+cl_context createContext(cl_device_id* dIDs, cl_uint n);
 cl_command_queue createQueue(cl_context ctx, cl_device_id dID);
-cl_mem createRWBuffer(cl_context ctx, size_t size, void* data);
+cl_mem createWRBuffer(cl_context ctx, size_t size, void* data);
 cl_mem createRBuffer(cl_context ctx, size_t size, void* data);
 cl_mem createWBuffer(cl_context ctx, size_t size, void* data);
-cl_program createProgram(cl_context ctx, cl_device_id dID);
-cl_kernel createKernel(cl_program prog, char* kernel_name);
-void blackAndWhite(int* r, int* g, int* b, int** ret,
-		size_t nb_pixel, size_t data_size);
-void edgeD(int* gShades , int** sobel, int width, int height,
-                size_t nb_pixel, size_t data_size);
-void houghLine( int* sobel, int** houghL, int width, int height,
-                size_t nb_pixel, size_t data_size);
-void findLine(int* accumulator, size_t nbLine, size_t accSize, int** ids);
+cl_program createProgram(cl_context ctx, cl_device_id* dIDs, cl_uint n);
+cl_program createProgramAocx(cl_context ctx, cl_device_id* dIDs, cl_uint n);
+cl_program createProgramSource(cl_context ctx, cl_device_id* dIDs,
+		cl_uint n);
+unsigned char* loadFile(const char* path, size_t* size);
+void buildProgram(cl_program prog, cl_device_id* dIDs, cl_uint n);
+cl_kernel createKernel(cl_program prog, const char* kernel_name);
+void setArg(cl_kernel ker, cl_uint id, size_t size, const void* value,
+		const char* name);
+void readBuffer(cl_command_queue q, cl_mem buff, size_t offset, size_t size,
+		void* data, cl_event* ev);
+cl_event* profEvent(const char* name, const char* type, int dev);
+cl_ulong hostTime();
+void profHost(const char* name, cl_ulong start, cl_ulong end);
+void profileReport(const char* image, int width, int height);
+void writeJsonString(FILE* file, const char* str);
+int houghPhiDim(float discStepPhi);
+int houghRNeg(int width, float discStepR);
+int houghRDim(int width, int height, float discStepR);
+void releaseBuffer(cl_mem* buff);
+void pipelineInit(Pipeline* p, int houghMode, int sobelMode, int phiWin,
+		bool compact, int edgeMode, bool acc16);
+void pipelineResize(Pipeline* p, int width, int height);
+void pipelineReleaseBuffers(Pipeline* p);
+void pipelineRelease(Pipeline* p);
+void blackAndWhite(Pipeline* p, png_bytep pixels, unsigned char** ret);
+void edgeD(Pipeline* p, int** sobel);
+void enqueueSobel(Pipeline* p, Band* b, int mode, cl_event* ev);
+void enqueueCanny(Pipeline* p, Band* b, int dev);
+void benchSobel(Pipeline* p, int iters);
+void houghLine(Pipeline* p, int** houghL);
+int houghCoarse(Pipeline* p, int nbLine, int** ids);
+void readEdgeList(Pipeline* p, int** sobel);
+int topLines(Pipeline* p, int nbLine, int** ids);
+int findLine(int* accumulator, size_t nbLine, int rDim, int phiDim,
+		int** ids);
+void usage(const char* prog);
+void deviceOptions(char* str, int houghMode, int sobelMode, bool compact,
+		int edgeMode);
+int listDirectory(const char* dir, char*** paths);
+int listFile(const char* file, char*** paths);
+void* decodeThread(void* arg);
+void computeFrame(Pipeline* p, Frame* f);
+void computeFrameCPU(CpuPipeline* p, Frame* f);
+void* encodeThread(void* arg);
 
 void checkErr(cl_int status, const char *errmsg);
 
 // openCL variables
 cl_int status; // for error code
 cl_platform_id platform = NULL;
-cl_device_id device = NULL;
+cl_device_id devices[MAX_DEVICES];
 cl_context context = NULL;
-cl_command_queue queue = NULL;
+cl_command_queue queues[MAX_DEVICES];
 cl_program program = NULL;
 
-int accumulator_s;
-int rDim_s;
-int phiDim_s;
+// device selection, the first device of the first platform by default
+const char* platformName = NULL; // substring of the platform name
+cl_device_type deviceType = CL_DEVICE_TYPE_ALL;
+cl_uint deviceIndex = 0; // among the devices of that type
+cl_uint nbDevices = 1; // devices from deviceIndex on splitting each image
+
+int programMode = PROGRAM_AOCX;
+const char* buildOptions = ""; // -D of -m / -t, part of the cache key
 
-int main(){
+int backend = BACKEND_OPENCL;
+int benchIters = 0; // sobel benchmark launches per variant and image
+int nmsR = HOUGH_NMS_R; // peak window of the line finding, see findLine
+int nmsPhi = HOUGH_NMS_PHI;
+
+FILE* profFile = NULL; // per image JSON records, NULL -> stdout summary
+ProfEvent profEvents[MAX_PROF_EVENTS]; // commands of the current image
+int nbProf = 0;
+
+int main(int argc, char** argv){
 	// time
 	struct timeval tp;
-	int start, openCL, stop;
+	int start, stop;
 
 	gettimeofday(&tp, NULL);
 	start = tp.tv_sec * 1000 + tp.tv_usec/1000;
@@ -56,104 +318,621 @@ int main(){
 	// begin main
 	printf("YOLO world\n");
 
-	// image paremeters
-	int width;
-	int height;
-	int *r,*g,*b,*img,*sobel,*accumulator,*lineIDs;
-	png_bytep *row_pointers;
+	// images to process
+	char** inPaths;
+	char** outPaths;
+	int nbImg;
+	const char* dir = NULL;
+	const char* list = NULL;
+	const char* outDir = ".";
+	const char* profPath = NULL;
+	int houghMode = HOUGH_NDRANGE;
+	int phiWin = HOUGH_PHI_WIN;
+	int sobelMode = SOBEL_TILED;
+	bool compact = false;
+	int edgeMode = EDGE_SOBEL;
+	int magnitude = -1; // -1 : kernel defaults
+	int low = -1;
+	int high = -1;
+	bool acc16 = false;
+	char options[256] = "";
+	bool listMode = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:l:o:p:H:w:N:a:S:cE:m:t:B:b:P:T:i:n:Lk:")) != -1){
+		switch(opt){
+			case 'd': dir = optarg; break;
+			case 'l': list = optarg; break;
+			case 'o': outDir = optarg; break;
+			case 'p': profPath = optarg; break;
+			case 'H':
+				if(strcmp(optarg, "swi") == 0){
+					houghMode = HOUGH_SWI;
+				}else if(strcmp(optarg, "ndrange") == 0){
+					houghMode = HOUGH_NDRANGE;
+				}else if(strcmp(optarg, "oriented") == 0){
+					houghMode = HOUGH_ORIENTED;
+				}else if(strcmp(optarg, "coarse") == 0){
+					houghMode = HOUGH_COARSE;
+				}else{
+					printf("Unknown hough kernel %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'w':
+				// the oriented kernels wrap phi once, a wider window would
+				// vote twice for a phi or outside the tables
+				if(sscanf(optarg, "%d", &phiWin) != 1 || phiWin < 0
+					|| phiWin > (houghPhiDim(DISCRETE_PHI) - 1) / 2){
+					printf("phiWin between 0 and %d\n",
+						(houghPhiDim(DISCRETE_PHI) - 1) / 2);
+					usage(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'a':
+				if(strcmp(optarg, "16") == 0){
+					acc16 = true;
+				}else if(strcmp(optarg, "32") == 0){
+					acc16 = false;
+				}else{
+					printf("Accumulator counters are 16 or 32 bits\n");
+					exit(1);
+				}
+				break;
+			case 'N':
+				// 0:0 keeps every bin, the former findLine
+				if(sscanf(optarg, "%d:%d", &nmsR, &nmsPhi) != 2
+					|| nmsR < 0 || nmsPhi < 0){
+					printf("NMS window is r:phi\n");
+					exit(1);
+				}
+				break;
+			case 'S':
+				if(strcmp(optarg, "tiled") == 0){
+					sobelMode = SOBEL_TILED;
+				}else if(strcmp(optarg, "basic") == 0){
+					sobelMode = SOBEL_BASIC;
+				}else if(strcmp(optarg, "separable") == 0){
+					sobelMode = SOBEL_SEPARABLE;
+				}else if(strcmp(optarg, "fused") == 0){
+					sobelMode = SOBEL_FUSED;
+				}else if(strcmp(optarg, "swi") == 0){
+					sobelMode = SOBEL_SWI;
+				}else{
+					printf("Unknown sobel kernel %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'c': compact = true; break;
+			case 'E':
+				if(strcmp(optarg, "sobel") == 0){
+					edgeMode = EDGE_SOBEL;
+				}else if(strcmp(optarg, "canny") == 0){
+					edgeMode = EDGE_CANNY;
+				}else{
+					printf("Unknown edge detector %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'm':
+				if(strcmp(optarg, "sum") == 0){
+					magnitude = SOBEL_MAG_SUM;
+				}else if(strcmp(optarg, "l1") == 0){
+					magnitude = SOBEL_MAG_L1;
+				}else if(strcmp(optarg, "l2") == 0){
+					magnitude = SOBEL_MAG_L2;
+				}else if(strcmp(optarg, "l2fast") == 0){
+					magnitude = SOBEL_MAG_L2_FAST;
+				}else{
+					printf("Unknown gradient magnitude %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 't':
+				// sobel threshold and canny low, canny high after ':'
+				if(sscanf(optarg, "%d:%d", &low, &high) < 1){
+					printf("Thresholds are low[:high]\n");
+					exit(1);
+				}
+				break;
+			case 'B': benchIters = atoi(optarg); break;
+			case 'b':
+				if(strcmp(optarg, "cpu") == 0){
+					backend = BACKEND_CPU;
+				}else if(strcmp(optarg, "opencl") == 0){
+					backend = BACKEND_OPENCL;
+				}else{
+					printf("Unknown backend %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'P': platformName = optarg; break;
+			case 'T':
+				if(strcmp(optarg, "cpu") == 0){
+					deviceType = CL_DEVICE_TYPE_CPU;
+				}else if(strcmp(optarg, "gpu") == 0){
+					deviceType = CL_DEVICE_TYPE_GPU;
+				}else if(strcmp(optarg, "accel") == 0){
+					deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+				}else if(strcmp(optarg, "all") == 0){
+					deviceType = CL_DEVICE_TYPE_ALL;
+				}else{
+					printf("Unknown device type %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'i': deviceIndex = atoi(optarg); break;
+			case 'n':
+				nbDevices = atoi(optarg);
+				if(nbDevices < 1 || nbDevices > MAX_DEVICES){
+					printf("Between 1 and %d devices\n", MAX_DEVICES);
+					exit(1);
+				}
+				break;
+			case 'L': listMode = true; break;
+			case 'k':
+				if(strcmp(optarg, "aocx") == 0){
+					programMode = PROGRAM_AOCX;
+				}else if(strcmp(optarg, "source") == 0){
+					programMode = PROGRAM_SOURCE;
+				}else{
+					printf("Unknown program kind %s\n", optarg);
+					exit(1);
+				}
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+
+	if(listMode){
+		listDevices();
+		return 0;
+	}
 
-	// Kernel var
-	if(openImg(&width, &height, &row_pointers) != 0){
-		printf("Failed opening image\n");
+	// kernel specialisation, every kernel is built for the given options
+	if(magnitude >= 0){
+		sprintf(options + strlen(options), "-DSOBEL_MAG=%d ", magnitude);
+	}
+	if(low >= 0){
+		sprintf(options + strlen(options),
+			"-DSOBEL_THRESHOLD=%d -DCANNY_LOW=%d ", low, low);
+	}
+	if(high >= 0){
+		sprintf(options + strlen(options), "-DCANNY_HIGH=%d ", high);
+	}
+	buildOptions = options;
+	if(options[0] != '\0' && programMode == PROGRAM_AOCX
+		&& backend == BACKEND_OPENCL){
+		printf("-m and -t need -k source, bin/kernel.aocx is built by"
+			" make kernel KERNEL_FLAGS=...\n");
+		exit(1);
+	}
+	// the host reads the counters back with the width it built them with,
+	// an aocx does not tell which one it has
+	if(acc16 && programMode == PROGRAM_AOCX){
+		printf("-a 16 needs -k source\n");
+		exit(1);
+	}
+	if(acc16 && backend == BACKEND_CPU){
+		printf("-a 16 is an openCL option, the CPU backend counts in ints\n");
+		exit(1);
+	}
+	if(acc16){
+		sprintf(options + strlen(options), "-DHOUGH_ACC16 ");
+	}
+	char deviceOnly[128];
+	deviceOptions(deviceOnly, houghMode, sobelMode, compact, edgeMode);
+	if(deviceOnly[0] != '\0' && backend == BACKEND_CPU){
+		printf("%s: openCL only, the CPU backend runs the sobel and ndrange"
+			" hough\n", deviceOnly);
 		exit(1);
 	}
 
-	size_t nb_pixel = width * height;
-	size_t data_size = nb_pixel * sizeof(int);
+	if(dir != NULL){
+		nbImg = listDirectory(dir, &inPaths);
+	}else if(list != NULL){
+		nbImg = listFile(list, &inPaths);
+	}else{ // default single image
+		nbImg = 1;
+		inPaths = (char**) malloc(sizeof(char*));
+		inPaths[0] = strdup("./bin/rlc.png");
+	}
 
-	if(getRGBpixel(&r,&g,&b,width,height, row_pointers) != 0){
-		printf("Failed getting RGB composants\n");
-		exit(1);
+	outPaths = (char**) malloc(nbImg * sizeof(char*));
+	for(int i = 0; i < nbImg; i++){
+		if(dir == NULL && list == NULL){
+			outPaths[i] = strdup("out.png");
+		}else{
+			const char* name = strrchr(inPaths[i], '/');
+			name = (name == NULL) ? inPaths[i] : name + 1;
+			outPaths[i] = (char*) malloc(strlen(outDir) + strlen(name) + 2);
+			sprintf(outPaths[i], "%s/%s", outDir, name);
+		}
 	}
 
-	init();
-	
-	// apply kernel to output black and white png
-	blackAndWhite(r, g, b, &img, nb_pixel, data_size);
+	printf("%d image(s) to process\n", nbImg);
 
-	// edge detection
-	edgeD(img, &sobel, width, height, nb_pixel, data_size);	
+	if(profPath != NULL){
+		profFile = fopen(profPath, "w");
+		if(profFile == NULL){
+			printf("Cannot open profile file %s\n", profPath);
+			exit(1);
+		}
+	}
 
-	// line detection accumulator : r,phi accumulator : (r,phi)
-	houghLine(sobel,&accumulator, width, height, nb_pixel, data_size);
+	if(backend == BACKEND_OPENCL && !init()){
+		// an explicit choice that cannot be honoured is an error
+		if(platformName != NULL || deviceType != CL_DEVICE_TYPE_ALL
+			|| deviceIndex != 0 || nbDevices != 1){
+			printf("Requested openCL device not found, see -L\n");
+			exit(1);
+		}
+		printf("No openCL platform, falling back to the CPU backend\n");
+		backend = BACKEND_CPU;
+		if(acc16){
+			printf("Warning : -a 16 ignored, the CPU backend counts in ints\n");
+		}
+		if(deviceOnly[0] != '\0'){
+			printf("Warning : %signored, the CPU backend runs the sobel and"
+				" ndrange hough\n", deviceOnly);
+		}
+	}
 
-	// end of openCl part
-	gettimeofday(&tp, NULL);
-	openCL = tp.tv_sec * 1000 + tp.tv_usec /1000;
+	Pipeline pipe;
+	CpuPipeline cpu;
+	cpuInit(0); // findLine runs on the cpu threads with both backends
+	if(backend == BACKEND_OPENCL){
+		pipelineInit(&pipe, houghMode, sobelMode, phiWin, compact,
+			edgeMode, acc16);
+	}else{
+		cpuPipelineInit(&cpu, DISCRETE_R, DISCRETE_PHI,
+			houghPhiDim(DISCRETE_PHI),
+			magnitude >= 0 ? magnitude : SOBEL_MAG_SUM,
+			low >= 0 ? low : SOBEL_THRESHOLD);
+	}
 
-	// find NB_LINES best lines
-	findLine(accumulator, NB_LINES, accumulator_s, &lineIDs );
+	// decode of image N+1 and encode of image N-1 run on their own
+	// thread while image N is on the device
+	Batch batch;
+	batch.inPaths = inPaths;
+	batch.outPaths = outPaths;
+	batch.nbImg = nbImg;
+	queueInit(&batch.decoded, BATCH_QUEUE_SIZE);
+	queueInit(&batch.computed, BATCH_QUEUE_SIZE);
+
+	pthread_t decoder, encoder;
+	pthread_create(&decoder, NULL, decodeThread, &batch);
+	pthread_create(&encoder, NULL, encodeThread, &batch);
+
+	int compute = 0;
+	Frame* f;
+	while((f = (Frame*) queuePop(&batch.decoded)) != NULL){
+		gettimeofday(&tp, NULL);
+		int begin = tp.tv_sec * 1000 + tp.tv_usec/1000;
+
+		if(backend == BACKEND_OPENCL){
+			computeFrame(&pipe, f);
+		}else{
+			computeFrameCPU(&cpu, f);
+		}
 
-	process(width, height, row_pointers, sobel);
+		gettimeofday(&tp, NULL);
+		compute += tp.tv_sec * 1000 + tp.tv_usec/1000 - begin;
 
-	printf("Draw lines \n");	
-	for(int i = 0 ; i < NB_LINES ; i++){
-		draw_line(row_pointers, rDim_s, phiDim_s, lineIDs[i],
-		 DISCRETE_R, DISCRETE_PHI, width, height);
+		queuePush(&batch.computed, f);
 	}
-	write_png_file(width, height, row_pointers);
+	queuePush(&batch.computed, NULL); // end of batch
+
+	pthread_join(decoder, NULL);
+	pthread_join(encoder, NULL);
 
 	printf("Cleaning up data (avoid memory leaks)\n");	
-	cleanup();
+	queueDestroy(&batch.decoded);
+	queueDestroy(&batch.computed);
 
-	free(lineIDs);
-	free(accumulator);
-	free(sobel);
-	free(img);	
-	
-	if(row_pointers){
-		for(int y = 0; y < height ; y++){
-			free(row_pointers[y]);
-			row_pointers[y] = NULL;
-		}
-		free(row_pointers);
-		row_pointers = NULL;
+	if(backend == BACKEND_OPENCL){
+		pipelineRelease(&pipe);
+		cleanup();
+	}else{
+		cpuPipelineRelease(&cpu);
+	}
+	cpuRelease();
+
+	if(profFile){
+		fclose(profFile);
+		profFile = NULL;
+	}
+
+	for(int i = 0; i < nbImg; i++){
+		free(inPaths[i]);
+		free(outPaths[i]);
 	}
+	free(inPaths);
+	free(outPaths);
 	
 	gettimeofday(&tp,NULL);
 	stop = tp.tv_sec * 1000 + tp.tv_usec /1000;
 
-	printf("Time all : %d , Time openCL execution : %d, acc size %d\n",
-		 stop - start, openCL - start, accumulator_s);
+	printf("Time all : %d , Time %s execution : %d, images %d\n",
+		 stop - start, backend == BACKEND_OPENCL ? "openCL" : "CPU",
+		 compute, nbImg);
 
 	return 0;
 }
 
+void usage(const char* prog){
+	printf("Usage : %s [-d imgDir | -l fileList] [-o outDir]"
+		" [-p profile.jsonl] [-H ndrange|swi|oriented|coarse]"
+		" [-w phiWin]"
+		" [-N nmsR:nmsPhi] [-a 16|32]"
+		" [-S tiled|basic|separable|fused|swi] [-c]"
+		" [-E sobel|canny] [-m sum|l1|l2|l2fast] [-t low[:high]]"
+		" [-B benchIters]"
+		" [-b opencl|cpu] [-P platform] [-T cpu|gpu|accel|all]"
+		" [-i deviceIndex] [-n nbDevices] [-L] [-k aocx|source]\n",
+		prog);
+}
+
+// options of the openCL pipeline that the CPU backend has no stage for,
+// as given on the command line ("" if none)
+void deviceOptions(char* str, int houghMode, int sobelMode, bool compact,
+		int edgeMode){
+	const char* houghNames[] = {"ndrange", "swi", "oriented", "coarse"};
+	const char* sobelNames[NB_SOBEL_MODES] = {"basic", "tiled", "separable",
+		"fused", "swi"};
+
+	str[0] = '\0';
+	if(houghMode != HOUGH_NDRANGE){
+		sprintf(str + strlen(str), "-H %s ", houghNames[houghMode]);
+	}
+	if(sobelMode != SOBEL_TILED){
+		sprintf(str + strlen(str), "-S %s ", sobelNames[sobelMode]);
+	}
+	if(compact){
+		sprintf(str + strlen(str), "-c ");
+	}
+	if(edgeMode == EDGE_CANNY){
+		sprintf(str + strlen(str), "-E canny ");
+	}
+	if(benchIters > 0){
+		sprintf(str + strlen(str), "-B %d ", benchIters);
+	}
+}
+
+int compareNames(const void* a, const void* b){
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int listDirectory(const char* dir, char*** paths){
+	DIR* d = opendir(dir);
+	struct dirent* entry;
+	int nb = 0;
+	int capacity = 16;
+	char** list = (char**) malloc(capacity * sizeof(char*));
+
+	if(d == NULL){
+		printf("Cannot open directory %s\n", dir);
+		exit(1);
+	}
+
+	while((entry = readdir(d)) != NULL){
+		size_t len = strlen(entry->d_name);
+		if(len < 4 || strcmp(entry->d_name + len - 4, ".png") != 0){
+			continue;
+		}
+		if(nb == capacity){
+			capacity *= 2;
+			list = (char**) realloc(list, capacity * sizeof(char*));
+		}
+		list[nb] = (char*) malloc(strlen(dir) + len + 2);
+		sprintf(list[nb], "%s/%s", dir, entry->d_name);
+		nb++;
+	}
+	closedir(d);
+
+	// readdir order is arbitrary, keep runs reproducible
+	qsort(list, nb, sizeof(char*), compareNames);
+
+	*paths = list;
+	return nb;
+}
+
+int listFile(const char* file, char*** paths){
+	FILE* fp = fopen(file, "r");
+	char line[4096];
+	int nb = 0;
+	int capacity = 16;
+	char** list = (char**) malloc(capacity * sizeof(char*));
+
+	if(fp == NULL){
+		printf("Cannot open file list %s\n", file);
+		exit(1);
+	}
+
+	while(fgets(line, sizeof(line), fp) != NULL){
+		line[strcspn(line, "\r\n")] = '\0';
+		if(line[0] == '\0'){
+			continue;
+		}
+		if(nb == capacity){
+			capacity *= 2;
+			list = (char**) realloc(list, capacity * sizeof(char*));
+		}
+		list[nb] = strdup(line);
+		nb++;
+	}
+	fclose(fp);
+
+	*paths = list;
+	return nb;
+}
+
+void* decodeThread(void* arg){
+	Batch* batch = (Batch*) arg;
+
+	for(int i = 0; i < batch->nbImg; i++){
+		Frame* f = (Frame*) malloc(sizeof(Frame));
+		f->inPath = batch->inPaths[i];
+		f->outPath = batch->outPaths[i];
+
+		if(openImg(batch->inPaths[i], &f->width, &f->height, &f->rows) != 0){
+			printf("Failed opening image %s, skipped\n", batch->inPaths[i]);
+			free(f);
+			continue;
+		}
+
+		queuePush(&batch->decoded, f); // blocks if compute is behind
+	}
+	queuePush(&batch->decoded, NULL); // end of batch
+
+	return NULL;
+}
+
+void computeFrame(Pipeline* p, Frame* f){
+	int *accumulator;
+
+	pipelineResize(p, f->width, f->height);
+
+	// The intermediate images stay on the device, only the edge image
+	// (drawn in the output) and the accumulator are read back
+
+	// apply kernel to output black and white png
+	blackAndWhite(p, f->rows[0], NULL);
+
+	if(benchIters > 0){
+		benchSobel(p, benchIters);
+	}
+
+	// edge detection, the compacted edges are read after hough
+	edgeD(p, p->compact ? NULL : &f->sobel);
+
+	// line detection accumulator : r,phi accumulator : (r,phi)
+	// find NB_LINES best lines, on the device when it holds every vote
+	if(p->houghMode == HOUGH_COARSE){
+		f->nbLines = houghCoarse(p, NB_LINES, &f->lineIDs);
+	}else if(p->nbBands == 1){
+		houghLine(p, NULL);
+		f->nbLines = topLines(p, NB_LINES, &f->lineIDs);
+	}else{
+		houghLine(p, &accumulator);
+		f->nbLines = findLine(accumulator, NB_LINES, p->rDim, p->phiDim,
+			&f->lineIDs);
+		free(accumulator);
+	}
+
+	if(p->compact){
+		readEdgeList(p, &f->sobel);
+	}
+
+	profileReport(f->inPath, f->width, f->height);
+
+	f->rDim = p->rDim;
+	f->rNeg = p->rNeg;
+	f->phiDim = p->phiDim;
+}
+
+// same stages as computeFrame on the CPU backend
+void computeFrameCPU(CpuPipeline* p, Frame* f){
+	cl_ulong t0, t1, t2, t3;
+
+	cpuPipelineResize(p, f->width, f->height,
+		houghRDim(f->width, f->height, p->discStepR),
+		houghRNeg(f->width, p->discStepR));
+
+	// edge image belongs to the frame, freed once drawn
+	f->sobel = (int*) malloc(p->nb_pixel * sizeof(int));
+	if(f->sobel == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
+
+	t0 = hostTime();
+	cpuGreyShade(p, f->rows[0]);
+	t1 = hostTime();
+	cpuSobel(p, f->sobel);
+	t2 = hostTime();
+	cpuHoughLine(p, f->sobel);
+	t3 = hostTime();
+
+	profHost("grey_shade", t0, t1);
+	profHost("sobel", t1, t2);
+	profHost("houghLine", t2, t3);
+
+	f->nbLines = findLine(p->acc, NB_LINES, p->rDim, p->phiDim,
+		&f->lineIDs);
+
+	profileReport(f->inPath, f->width, f->height);
+
+	f->rDim = p->rDim;
+	f->rNeg = p->rNeg;
+	f->phiDim = p->phiDim;
+}
+
+void* encodeThread(void* arg){
+	Batch* batch = (Batch*) arg;
+	Frame* f;
+
+	while((f = (Frame*) queuePop(&batch->computed)) != NULL){
+		process(f->width, f->height, f->rows, f->sobel);
+
+		printf("Draw lines \n");	
+		for(int i = 0 ; i < f->nbLines ; i++){
+			draw_line(f->rows, f->rDim, f->rNeg, f->phiDim, f->lineIDs[i],
+			 DISCRETE_R, DISCRETE_PHI, f->width, f->height);
+		}
+		write_png_file(f->outPath, f->width, f->height, f->rows);
+
+		free(f->lineIDs);
+		free(f->sobel);
+
+		free(f->rows[0]); // rows share one pixel block
+		free(f->rows);
+		free(f);
+	}
+
+	return NULL;
+}
+
 bool init(){
 	// find platform id
-	platform = findPlatform("Altera");
+	platform = findPlatform(platformName);
+	if(platform == NULL){
+		return false;
+	}
 
 	// find devices
-	device = findDevices(platform);
+	findDevices(platform, devices, nbDevices);
 	
 	// create context
-	context = createContext(device);
+	context = createContext(devices, nbDevices);
 
-	// create command queue	
-	queue = createQueue(context, device);	
+	// create command queues, one per device
+	for(cl_uint i = 0; i < nbDevices; i++){
+		queues[i] = createQueue(context, devices[i]);
+	}
 
 	// create program
-	program = createProgram(context, device);
+	program = createProgram(context, devices, nbDevices);
 
+	return true;
 }
 
+// first platform whose name contains platformName (any if NULL) and
+// that has the requested devices, NULL when there is none
 cl_platform_id findPlatform(const char *platformName){
 	cl_uint num_platforms;
 
 	printf("Getting number of openCL platform avialable : ");
 	
+	// no ICD installed is not an error, the CPU backend takes over
 	status = clGetPlatformIDs(0,NULL, &num_platforms);
-	checkErr(status, "Failed getting number of openClPlatoform");
+	if(status != CL_SUCCESS || num_platforms == 0){
+		printf("none found\n");
+		return NULL;
+	}
 	
 	printf("Number of openCL plateform : %d\n", num_platforms);
 
@@ -164,44 +943,137 @@ cl_platform_id findPlatform(const char *platformName){
 	// Get a list of all those platofrms IDs
 	status = clGetPlatformIDs(num_platforms, pIDs, NULL);
 	checkErr(status, "Failed retriving all platforms IDs");
-	
 
-	return pIDs[0];
+	char name[1024];
+	for(cl_uint i = 0; i < num_platforms; i++){
+		clGetPlatformInfo(pIDs[i], CL_PLATFORM_NAME, sizeof(name), name, NULL);
+		if(platformName != NULL && strcasestr(name, platformName) == NULL){
+			continue;
+		}
+
+		cl_uint num_devices = 0;
+		status = clGetDeviceIDs(pIDs[i], deviceType, 0, NULL, &num_devices);
+		if(status != CL_SUCCESS || num_devices < deviceIndex + nbDevices){
+			continue;
+		}
+
+		printf("Using platform %s\n", name);
+		return pIDs[i];
+	}
+
+	printf("No platform with %s devices %d to %d%s%s\n",
+		deviceTypeName(deviceType), deviceIndex, deviceIndex + nbDevices - 1,
+		platformName ? " matching " : "",
+		platformName ? platformName : "");
+	return NULL;
 }
 
-cl_device_id findDevices(cl_platform_id pid){
+// n devices of type deviceType from deviceIndex on, findPlatform checked
+// they exist
+void findDevices(cl_platform_id pid, cl_device_id* dIDs, cl_uint n){
 	cl_uint num_devices;
 
 	printf("Getting number of openCL devices : ");
 
-	status = clGetDeviceIDs(pid, CL_DEVICE_TYPE_ALL ,0 , NULL, &num_devices);
+	status = clGetDeviceIDs(pid, deviceType, 0, NULL, &num_devices);
 	checkErr(status, "No AOCL devices found");
 
-	cl_device_id dIDs [num_devices];
+	cl_device_id all [num_devices];
 
 	printf("Retriving device ID : ");
 
-	status = clGetDeviceIDs(pid, CL_DEVICE_TYPE_ALL, num_devices, dIDs,NULL);
+	status = clGetDeviceIDs(pid, deviceType, num_devices, all, NULL);
 	checkErr(status, "Failed retriving device ID");
 
 	char deviceName[1024]; // gonna hold device name
 	char vendorName[1024]; // gonna hold vendor name
 
-	clGetDeviceInfo(dIDs[0], CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
-	clGetDeviceInfo(dIDs[0], CL_DEVICE_VENDOR, sizeof(vendorName), vendorName, NULL);
+	for(cl_uint i = 0; i < n; i++){
+		dIDs[i] = all[deviceIndex + i];
+		clGetDeviceInfo(dIDs[i], CL_DEVICE_NAME, sizeof(deviceName),
+			deviceName, NULL);
+		clGetDeviceInfo(dIDs[i], CL_DEVICE_VENDOR, sizeof(vendorName),
+			vendorName, NULL);
 
-	printf("Executing openCL kernel on %s\n", deviceName);
-	printf("Sold by : %s\n", vendorName);
+		printf("Executing openCL kernel on %s\n", deviceName);
+		printf("Sold by : %s\n", vendorName);
+	}
+}
 
-	return dIDs[0]; // only keep first one 
+const char* deviceTypeName(cl_device_type type){
+	if(type == CL_DEVICE_TYPE_ALL) return "any";
+	if(type & CL_DEVICE_TYPE_ACCELERATOR) return "accel";
+	if(type & CL_DEVICE_TYPE_GPU) return "gpu";
+	if(type & CL_DEVICE_TYPE_CPU) return "cpu";
+	return "other";
 }
 
-cl_context createContext(cl_device_id dID){
+// print every platform and device with what matters to pick one (-L)
+void listDevices(){
+	cl_uint num_platforms = 0;
+
+	status = clGetPlatformIDs(0, NULL, &num_platforms);
+	if(status != CL_SUCCESS || num_platforms == 0){
+		printf("No openCL platform\n");
+		return;
+	}
+
+	cl_platform_id pIDs [num_platforms];
+	status = clGetPlatformIDs(num_platforms, pIDs, NULL);
+	checkErr(status, "Failed retriving all platforms IDs");
+
+	char name[1024];
+	for(cl_uint i = 0; i < num_platforms; i++){
+		clGetPlatformInfo(pIDs[i], CL_PLATFORM_NAME, sizeof(name), name, NULL);
+		printf("Platform %d : %s\n", i, name);
+
+		cl_uint num_devices = 0;
+		status = clGetDeviceIDs(pIDs[i], CL_DEVICE_TYPE_ALL, 0, NULL,
+			&num_devices);
+		if(status != CL_SUCCESS || num_devices == 0){
+			printf("  no device\n");
+			continue;
+		}
+
+		cl_device_id dIDs [num_devices];
+		status = clGetDeviceIDs(pIDs[i], CL_DEVICE_TYPE_ALL, num_devices,
+			dIDs, NULL);
+		checkErr(status, "Failed retriving device ID");
+
+		for(cl_uint j = 0; j < num_devices; j++){
+			cl_device_type type;
+			cl_uint computeUnits, clock;
+			cl_ulong globalMem, localMem;
+			size_t maxWG;
+
+			clGetDeviceInfo(dIDs[j], CL_DEVICE_NAME, sizeof(name), name, NULL);
+			clGetDeviceInfo(dIDs[j], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+			clGetDeviceInfo(dIDs[j], CL_DEVICE_MAX_COMPUTE_UNITS,
+				sizeof(computeUnits), &computeUnits, NULL);
+			clGetDeviceInfo(dIDs[j], CL_DEVICE_MAX_CLOCK_FREQUENCY,
+				sizeof(clock), &clock, NULL);
+			clGetDeviceInfo(dIDs[j], CL_DEVICE_GLOBAL_MEM_SIZE,
+				sizeof(globalMem), &globalMem, NULL);
+			clGetDeviceInfo(dIDs[j], CL_DEVICE_LOCAL_MEM_SIZE,
+				sizeof(localMem), &localMem, NULL);
+			clGetDeviceInfo(dIDs[j], CL_DEVICE_MAX_WORK_GROUP_SIZE,
+				sizeof(maxWG), &maxWG, NULL);
+
+			printf("  Device %d : %s (%s)\n", j, name, deviceTypeName(type));
+			printf("    compute units %u @ %u MHz, global mem %lu MB,"
+				" local mem %lu KB, max work-group %zu\n", computeUnits, clock,
+				(unsigned long) (globalMem >> 20),
+				(unsigned long) (localMem >> 10), maxWG);
+		}
+	}
+}
+
+cl_context createContext(cl_device_id* dIDs, cl_uint n){
 	cl_context ctx;
 
 	printf("Create context : ");
 
-	ctx = clCreateContext(NULL, 1, &dID, NULL, NULL, &status);
+	ctx = clCreateContext(NULL, n, dIDs, NULL, NULL, &status);
 	checkErr(status,"Failed while creating context");
 
 	return ctx;
@@ -284,62 +1156,39 @@ cl_command_queue createQueue(cl_context ctx, cl_device_id dID){
 	return queue;
 }
 
-cl_program createProgram(cl_context ctx, cl_device_id dID){
-
-	/* //CODE FOR ANYTHING THAT IS NOT FPGA
-	FILE* fp;
-	const char fileName[] = "./device/kernel.cl";
-	size_t source_size;
-	char* source_str;
-	cl_int ret;
-
-	fp = fopen(fileName, "r");
-
-	source_str = (char*) malloc(0x100000);
-	source_size = fread(source_str,1, 0x100000,fp);
-	fclose(fp);
-
-	cl_program prog = clCreateProgramWithSource(ctx, 1, (const char **)&source_str, (const size_t *)&source_size, &ret);
-	checkErr(ret, "Failed create program");
-
-	ret = clBuildProgram(prog, 1, &dID, NULL,NULL,NULL);
-	checkErr(ret, "Failed build program");
+cl_program createProgram(cl_context ctx, cl_device_id* dIDs, cl_uint n){
+	if(programMode == PROGRAM_SOURCE){
+		return createProgramSource(ctx, dIDs, n);
+	}
+	return createProgramAocx(ctx, dIDs, n);
+}
 
-	return prog;
-*/
-	
+cl_program createProgramAocx(cl_context ctx, cl_device_id* dIDs, cl_uint n){
 	cl_program prog;
-	FILE* fp;
 	size_t size;
 	unsigned char* binary =  NULL;
-	cl_int binaryStatus;
+	cl_int binaryStatus[n];
 	
 	printf("Looking for .aocx file\n");
 
-	// Open file and get size
-	fp = fopen("bin/kernel.aocx","r");
-
-	if(fp == NULL){	
+	binary = loadFile("bin/kernel.aocx", &size);
+	if(binary == NULL){	
 		printf("Cannot find AOCX file \n");
 		exit(1);
 	}
 
-	fseek(fp, 0, SEEK_END);
-	size = ftell(fp);
-	rewind(fp);
-
-	// read .aocx
-	binary = (unsigned char*)malloc(size + 1);  
-	binary[size] = '\0'; // EOF char
-	fread(binary, sizeof(char), size, fp);
-	fclose(fp);
-	fp = NULL;
+	// same image for every board
+	size_t sizes[n];
+	const unsigned char* binaries[n];
+	for(cl_uint i = 0; i < n; i++){
+		sizes[i] = size;
+		binaries[i] = binary;
+	}
 
 	printf("Creating program : ");
 
-	prog = clCreateProgramWithBinary(ctx, 1, &dID, &size,
-					 (const unsigned char**)(&binary),
-					&binaryStatus,
+	prog = clCreateProgramWithBinary(ctx, n, dIDs, sizes, binaries,
+					binaryStatus,
 					&status);
 	checkErr(status, "Failed creating program");
 	free(binary); // free binary
@@ -353,7 +1202,169 @@ cl_program createProgram(cl_context ctx, cl_device_id dID){
 	return prog;
 }
 
-cl_kernel createKernel(cl_program prog, char *kernel_name){
+/**
+ * Build device/kernel.cl for CPU / GPU runtimes. The binary of each device
+ * is saved in PROGRAM_CACHE_DIR under a hash of everything it depends on
+ * (device, driver, build options, source) and reloaded on later runs,
+ * a missing, stale or foreign binary just falls back to the source build.
+ */
+cl_program createProgramSource(cl_context ctx, cl_device_id* dIDs,
+		cl_uint n){
+	cl_program prog;
+	size_t sourceSize;
+	char* source;
+
+	source = (char*) loadFile("device/kernel.cl", &sourceSize);
+	if(source == NULL){
+		printf("Cannot find device/kernel.cl\n");
+		exit(1);
+	}
+
+	char cachePaths[n][256];
+	size_t sizes[n];
+	unsigned char* binaries[n];
+	cl_uint nbCached = 0;
+
+	for(cl_uint d = 0; d < n; d++){
+		// FNV-1a over the cache key
+		char deviceName[1024];
+		char driver[1024];
+		clGetDeviceInfo(dIDs[d], CL_DEVICE_NAME, sizeof(deviceName),
+			deviceName, NULL);
+		clGetDeviceInfo(dIDs[d], CL_DRIVER_VERSION, sizeof(driver), driver,
+			NULL);
+
+		const char* keys[4] = {deviceName, driver, buildOptions, source};
+		size_t lens[4] = {strlen(deviceName) + 1, strlen(driver) + 1,
+			strlen(buildOptions) + 1, sourceSize};
+		unsigned long long hash = 14695981039346656037ULL;
+		for(int k = 0; k < 4; k++){
+			for(size_t i = 0; i < lens[k]; i++){
+				hash = (hash ^ (unsigned char) keys[k][i]) * 1099511628211ULL;
+			}
+		}
+
+		sprintf(cachePaths[d], "%s/kernel_%016llx.bin", PROGRAM_CACHE_DIR,
+			hash);
+		binaries[d] = loadFile(cachePaths[d], &sizes[d]);
+		nbCached += binaries[d] != NULL;
+	}
+
+	// every device must have its binary, else everything is rebuilt
+	if(nbCached == n){
+		cl_int binaryStatus[n];
+		bool valid = true;
+
+		printf("Loading cached program %s : ", cachePaths[0]);
+		prog = clCreateProgramWithBinary(ctx, n, dIDs, sizes,
+			(const unsigned char**) binaries, binaryStatus, &status);
+		for(cl_uint d = 0; d < n; d++){
+			valid = valid && binaryStatus[d] == CL_SUCCESS;
+		}
+
+		if(status == CL_SUCCESS && valid){
+			status = clBuildProgram(prog, n, dIDs, buildOptions, NULL, NULL);
+			if(status == CL_SUCCESS){
+				printf("SUCCESS\n");
+				for(cl_uint d = 0; d < n; d++){
+					free(binaries[d]);
+				}
+				free(source);
+				return prog;
+			}
+		}
+		if(prog != NULL){
+			clReleaseProgram(prog);
+		}
+		printf("rejected, rebuilding\n");
+	}
+	for(cl_uint d = 0; d < n; d++){
+		free(binaries[d]);
+	}
+
+	printf("Creating program from source : ");
+	prog = clCreateProgramWithSource(ctx, 1, (const char**) &source,
+		&sourceSize, &status);
+	checkErr(status, "Failed creating program");
+	free(source);
+
+	buildProgram(prog, dIDs, n);
+
+	// save the binaries, a failure only costs a rebuild next time
+	status = clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(sizes),
+		sizes, NULL);
+	if(status != CL_SUCCESS){
+		return prog;
+	}
+
+	for(cl_uint d = 0; d < n; d++){
+		binaries[d] = (unsigned char*) malloc(sizes[d]);
+	}
+	status = clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(binaries),
+		binaries, NULL);
+
+	mkdir(PROGRAM_CACHE_DIR, 0755);
+	for(cl_uint d = 0; d < n; d++){
+		FILE* fp = fopen(cachePaths[d], "wb");
+		if(status == CL_SUCCESS && fp != NULL && sizes[d] > 0){
+			fwrite(binaries[d], 1, sizes[d], fp);
+			printf("Program cached in %s\n", cachePaths[d]);
+		}else{
+			printf("Cannot cache program in %s\n", cachePaths[d]);
+		}
+		if(fp != NULL){
+			fclose(fp);
+		}
+		free(binaries[d]);
+	}
+
+	return prog;
+}
+
+// whole file in a malloc'd buffer (NUL terminated), NULL if missing
+unsigned char* loadFile(const char* path, size_t* size){
+	FILE* fp = fopen(path, "rb");
+	if(fp == NULL){
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	rewind(fp);
+
+	unsigned char* data = (unsigned char*) malloc(*size + 1);
+	data[*size] = '\0';
+	if(fread(data, 1, *size, fp) != *size){
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+
+	return data;
+}
+
+// build for every device, print the compiler logs on failure
+void buildProgram(cl_program prog, cl_device_id* dIDs, cl_uint n){
+	printf("Building program %s: ", buildOptions);
+
+	status = clBuildProgram(prog, n, dIDs, buildOptions, NULL, NULL);
+	if(status != CL_SUCCESS){
+		for(cl_uint d = 0; d < n; d++){
+			size_t logSize;
+			clGetProgramBuildInfo(prog, dIDs[d], CL_PROGRAM_BUILD_LOG, 0,
+				NULL, &logSize);
+			char* log = (char*) malloc(logSize + 1);
+			clGetProgramBuildInfo(prog, dIDs[d], CL_PROGRAM_BUILD_LOG,
+				logSize, log, NULL);
+			log[logSize] = '\0';
+			printf("\n%s\n", log);
+			free(log);
+		}
+	}
+	checkErr(status, "Failed building program");
+}
+
+cl_kernel createKernel(cl_program prog, const char *kernel_name){
 	cl_kernel ker;
 	
 	printf("Creating kernel : ");
@@ -364,310 +1375,1387 @@ cl_kernel createKernel(cl_program prog, char *kernel_name){
 	return ker;
 }
 
-void blackAndWhite(int* r, int* g, int* b, int** ret,
-		 size_t nb_pixel, size_t data_size){
-
-	// Create buffers 
-	cl_mem red = 	createRBuffer(context, data_size, r);
-	cl_mem green = createRBuffer(context, data_size, g);
-	cl_mem blue = 	createRBuffer(context, data_size, b);
-	cl_mem grey =	createWBuffer(context, data_size, NULL);
-
-	// Free rgb buffers
-	free(r);
-	free(g);
-	free(b);
+// non blocking, data is only valid after a clFinish of q
+void readBuffer(cl_command_queue q, cl_mem buff, size_t offset, size_t size,
+		void* data, cl_event* ev){
+	printf("Reading results : ");
+	status = clEnqueueReadBuffer(
+			q, buff, CL_FALSE, offset, size, data, 0, NULL, ev);
+	checkErr(status, "Failed reading result from buffer");
+}
 
-	// create kernel
-	cl_kernel greyshades = createKernel(program, "grey_shade");
+cl_event* profEvent(const char* name, const char* type, int dev){
+	if(nbProf == MAX_PROF_EVENTS){
+		printf("Too many profiled commands for one image\n");
+		exit(1);
+	}
 
-	//loading kernel arguments
-	printf("Loading kernel args\n");
-	printf("Red, ");
-	status = clSetKernelArg(greyshades, 0, sizeof(cl_mem), &red);
-	checkErr(status, "Failed loading kernel args");
-	printf("green, ");
-	status = clSetKernelArg(greyshades, 1, sizeof(cl_mem), &green);
-	checkErr(status, "Failed loading kernel args");
-	printf("blue, ");
-	status = clSetKernelArg(greyshades, 2, sizeof(cl_mem), &blue);
-	checkErr(status, "Failed loading kernel args");
-	printf("grey, ");
-	status = clSetKernelArg(greyshades, 3, sizeof(cl_mem), &grey);
-	checkErr(status, "Failed loading kernel args");
+	ProfEvent* e = &profEvents[nbProf++];
+	e->name = name;
+	e->type = type;
+	e->dev = dev;
+	e->ev = NULL;
 
-	size_t globalWorkSize[1];	
-	globalWorkSize[0] = nb_pixel;
+	return &e->ev;
+}
 
-	int *img = (int*)malloc(data_size);
-	
-	// Executing kernel
-	printf("Executing kernel : ");
-	status = clEnqueueNDRangeKernel(
-		queue, greyshades, 1, NULL, globalWorkSize, NULL, 0, NULL,NULL);
-	checkErr(status, "Failed executing kernel");
+cl_ulong hostTime(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (cl_ulong) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	// Reading results
-	printf("Reading results : ");
-	status = clEnqueueReadBuffer(
-			queue, grey, CL_TRUE, 0, data_size, img, 0, NULL, NULL);
-	checkErr(status, "Failed reading result from buffer");
+void profHost(const char* name, cl_ulong start, cl_ulong end){
+	profEvent(name, "kernel", 0);
 
-	*ret = img;
+	ProfEvent* e = &profEvents[nbProf - 1];
+	e->t[0] = start;
+	e->t[1] = start;
+	e->t[2] = start;
+	e->t[3] = end;
+}
 
-	// Cleanup
-	if(red){
-		clReleaseMemObject(red);
-		red = NULL;
+// str as a JSON string, quotes, backslashes and control chars escaped
+void writeJsonString(FILE* file, const char* str){
+	fputc('"', file);
+	for(; *str; str++){
+		unsigned char c = (unsigned char) *str;
+
+		if(c == '"' || c == '\\'){
+			fprintf(file, "\\%c", c);
+		}else if(c < 0x20){
+			fprintf(file, "\\u%04x", c);
+		}else{
+			fputc(c, file);
+		}
 	}
-	if(green){
-		clReleaseMemObject(green);
-		green = NULL;
+	fputc('"', file);
+}
+
+/**
+ * Reads QUEUED/SUBMIT/START/END (ns, device clock) of every command of the
+ * image and writes them as one JSON line in profFile, or a short summary on
+ * stdout when no profile file was given. Events are released afterward.
+ */
+void profileReport(const char* image, int width, int height){
+	cl_ulong kernelTime = 0;
+	cl_ulong transferTime = 0;
+
+	for(cl_uint i = 0; backend == BACKEND_OPENCL && i < nbDevices; i++){
+		status = clFinish(queues[i]);
+		checkErr(status, "Failed waiting for the queue");
 	}
-	if(blue){
-		clReleaseMemObject(blue);
-		blue = NULL;
+
+	if(profFile){
+		fprintf(profFile, "{\"image\":");
+		writeJsonString(profFile, image);
+		fprintf(profFile, ",\"backend\":\"%s\",\"width\":%d,\"height\":%d,"
+			"\"events\":[", backend == BACKEND_OPENCL ? "opencl" : "cpu",
+			width, height);
 	}
-	if(grey){
-		clReleaseMemObject(grey);
-		grey = NULL;
+
+	for(int i = 0; i < nbProf; i++){
+		ProfEvent* e = &profEvents[i];
+		cl_ulong* t = e->t;
+
+		for(int j = 0; e->ev != NULL && j < 4; j++){
+			status = clGetEventProfilingInfo(e->ev,
+				CL_PROFILING_COMMAND_QUEUED + j, sizeof(cl_ulong), &t[j], NULL);
+			if(status != CL_SUCCESS){
+				printf("Failed reading profiling info of %s\n", e->name);
+				exit(status);
+			}
+		}
+
+		if(strcmp(e->type, "kernel") == 0){
+			kernelTime += t[3] - t[2];
+		}else{
+			transferTime += t[3] - t[2];
+		}
+
+		if(profFile){
+			fprintf(profFile, "%s{\"name\":\"%s\",\"type\":\"%s\","
+				"\"device\":%d,\"queued\":%llu,\"submit\":%llu,"
+				"\"start\":%llu,\"end\":%llu}", i ? "," : "", e->name,
+				e->type, e->dev,
+				(unsigned long long)t[0], (unsigned long long)t[1],
+				(unsigned long long)t[2], (unsigned long long)t[3]);
+		}else{
+			printf("Profile %-14s %-8s dev %d : %.3f ms\n", e->name,
+				e->type, e->dev, (t[3] - t[2]) / 1e6);
+		}
+
+		if(e->ev){
+			clReleaseEvent(e->ev);
+			e->ev = NULL;
+		}
 	}
-	if(greyshades){
-		clReleaseKernel(greyshades);
-		greyshades = NULL;
+
+	if(profFile){
+		fprintf(profFile, "],\"kernel_ns\":%llu,\"transfer_ns\":%llu}\n",
+			(unsigned long long)kernelTime,
+			(unsigned long long)transferTime);
 	}
+	printf("Device time kernels : %.3f ms, transfers : %.3f ms\n",
+		kernelTime / 1e6, transferTime / 1e6);
+
+	nbProf = 0;
 }
 
-void edgeD(	int* gShades , int** sobel, int width, int height,
-	 	size_t nb_pixel, size_t data_size){
+int houghPhiDim(float discStepPhi){
+	return (int) (M_PI/ discStepPhi);
+}
 
-	// ret value
-	int* edgeImg = (int*) malloc(data_size);
-	
-	// create buffers
-	cl_mem grey = createRBuffer(context, data_size, gShades);	
-	cl_mem edges = createWBuffer(context, data_size, NULL);
+// r = x * cos + y * sin >= -(width - 1) since sin >= 0 for phi in [0, pi)
+int houghRNeg(int width, float discStepR){
+	return (int) ((width - 1) / discStepR) + 1;
+}
 
-	// create kernel
-	cl_kernel edgeDetection = createKernel(program, "sobel");
-	size_t globalWorkSize[1];	
-	globalWorkSize[0] = nb_pixel;
+// r up to the diagonal, one bin of margin on each side for the rounding
+int houghRDim(int width, int height, float discStepR){
+	double diagonal = sqrt((double) width * width + (double) height * height);
 
+	return houghRNeg(width, discStepR) + (int) (diagonal / discStepR) + 2;
+}
 
-	// Load kernel args	
-	printf("Loading kernel args :\n");
-	printf("Grey shades, ");
-        status = clSetKernelArg(edgeDetection, 0, sizeof(cl_mem), &grey);
-        checkErr(status, "Failed loading kernel args");
-	
-	printf("width, ");
-	status = clSetKernelArg(edgeDetection, 1, sizeof(int), &width);
+void setArg(cl_kernel ker, cl_uint id, size_t size, const void* value,
+		const char* name){
+	printf("%s, ", name);
+	status = clSetKernelArg(ker, id, size, value);
 	checkErr(status, "Failed loading kernel args");
+}
 
-	printf("total pixels, ");
-	status = clSetKernelArg(edgeDetection, 2, sizeof(int), &nb_pixel);
-	checkErr(status, "Failed loading kernel args");
+void releaseBuffer(cl_mem* buff){
+	if(*buff){
+		clReleaseMemObject(*buff);
+		*buff = NULL;
+	}
+}
 
-	printf("Sobel buffer, ");
-	status = clSetKernelArg(edgeDetection, 3, sizeof(cl_mem), &edges);
-	checkErr(status, "Failed loading kernel args");
+void pipelineInit(Pipeline* p, int houghMode, int sobelMode, int phiWin,
+		bool compact, int edgeMode, bool acc16){
+	p->width = 0;
+	p->height = 0;
+	p->nb_pixel = 0;
+	p->data_size = 0;
+
+	p->discStepR = DISCRETE_R;
+	p->discStepPhi = DISCRETE_PHI;
+	p->rDim = 0;
+	p->phiDim = houghPhiDim(p->discStepPhi);
+	p->accSize = 0;
+	p->accBytes = acc16 ? sizeof(short) : sizeof(int);
+	p->houghMode = houghMode;
+	p->sobelMode = sobelMode;
+	p->phiWin = phiWin;
+	p->compact = compact;
+	p->edgeMode = edgeMode;
+	p->partAcc = NULL;
+	p->cRDim = 0;
+	p->cPhiDim = (p->phiDim + HOUGH_COARSE_PHI - 1) / HOUGH_COARSE_PHI;
+	p->curv = 0;
+	p->nbCand = 2 * NB_LINES;
+	p->winPhi = 0;
+	p->winR = 0;
+	p->rTol = 0;
+
+	// kernels are created only once for the whole run
+	p->nbBands = nbDevices;
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
+
+		b->queue = queues[i];
+		b->rgba = NULL;
+		b->grey = NULL;
+		b->edges = NULL;
+		b->dirs = NULL;
+		b->acc = NULL;
+		b->blur = NULL;
+		b->mag = NULL;
+		b->sector = NULL;
+		b->state = NULL;
+		b->edgeList = NULL;
+		b->edgeVals = NULL;
+		b->edgeCount = NULL;
+		b->listHost = NULL;
+		b->valsHost = NULL;
+		for(int k = 0; k < 2; k++){
+			b->topVotes[k] = NULL;
+			b->topBins[k] = NULL;
+		}
+		b->cand = NULL;
+		b->refineAcc = NULL;
+
+		b->greyKer = createKernel(program, "grey_shade");
+		b->sobelKer = createKernel(program, "sobel");
+		b->sobelTiledKer = createKernel(program, "sobelTiled");
+		b->sobelSepKer = createKernel(program, "sobelSeparable");
+		b->greySobelKer = createKernel(program, "greySobel");
+		b->sobelSwiKer = createKernel(program, "sobelSWI");
+		b->houghKer = createKernel(program, "houghLine");
+		b->houghSwiKer = createKernel(program, "houghLineSWI");
+		b->houghOrientKer = createKernel(program, "houghLineOriented");
+		b->clearKer = createKernel(program, "clear_buffer");
+		b->compactKer = createKernel(program, "compactEdges");
+		b->clearCountKer = createKernel(program, "clear_buffer");
+		b->houghListKer = createKernel(program, "houghLineList");
+		b->houghOrientListKer = createKernel(program,
+			"houghLineOrientedList");
+		b->cannyBlurKer = createKernel(program, "cannyBlur");
+		b->cannyGradKer = createKernel(program, "cannyGradient");
+		b->cannyNmsKer = createKernel(program, "cannyNMS");
+		b->cannyHystKer = createKernel(program, "cannyHysteresis");
+		b->cannyEdgesKer = createKernel(program, "cannyEdges");
+		b->topKer = createKernel(program, "topVotes");
+		b->coarseKer = createKernel(program, "houghLineCoarse");
+		b->refineKer = createKernel(program, "houghRefine");
+		b->clearRefineKer = createKernel(program, "clear_buffer");
+	}
 
-	// Executing kernel
-	printf("Executing kernel : ");
-	status = clEnqueueNDRangeKernel(
-		queue, edgeDetection, 1,NULL, globalWorkSize, NULL, 0, NULL,NULL);
-	checkErr(status, "Failed executing kernel");
+	// pre compute cos and sin, they only depend on phi and r discretisation.
+	// Fixed-point r bins : x * cos + y * sin needs no divide on the device
+	int *tabSin, *tabCos;
 
-	printf("Reading results : ");
-	status = clEnqueueReadBuffer(
-			queue, edges, CL_TRUE, 0, data_size, edgeImg, 0, NULL, NULL);
-	checkErr(status, "Failed reading result from buffer");
+	tabSin = (int*) malloc(p->phiDim * sizeof(int));
+	tabCos = (int*) malloc(p->phiDim * sizeof(int));
 
-	*sobel = edgeImg;
+	if(tabSin == NULL || tabCos == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
 
-	// cleanup
-	if(grey){
-		clReleaseMemObject(grey);
-		grey = NULL;
+	cpuHoughTables(p->discStepR, p->discStepPhi, p->phiDim, tabCos, tabSin);
+
+	p->sinBuf = createRBuffer(context, p->phiDim * sizeof(int), tabSin);
+	p->cosBuf = createRBuffer(context, p->phiDim * sizeof(int), tabCos);
+
+	free(tabSin);
+	free(tabCos);
+
+	// r of a tile spans at most its diagonal, +3 bins for truncation and
+	// the rounding margin of the kernel
+	p->win = (int) (HOUGH_TILE * sqrt(2.0) / p->discStepR) + 3;
+
+	// keep the slice within half of the smallest local memory
+	cl_ulong localMem = 0;
+	for(int i = 0; i < p->nbBands; i++){
+		cl_ulong mem;
+		status = clGetDeviceInfo(devices[i], CL_DEVICE_LOCAL_MEM_SIZE,
+				sizeof(mem), &mem, NULL);
+		checkErr(status, "Failed getting local memory size");
+		localMem = (i == 0 || mem < localMem) ? mem : localMem;
 	}
-	if(edges){
-		clReleaseMemObject(edges);
-		edges = NULL;
+
+	p->phiBand = HOUGH_PHI_BAND;
+	while(p->phiBand > 1 &&
+		p->phiBand * p->win * sizeof(int) > localMem / 2){
+		p->phiBand /= 2;
 	}
-	if(edgeDetection){
-		clReleaseKernel(edgeDetection);
-		edgeDetection = NULL;
+	printf("Hough local slice : %d phi x %d r\n", p->phiBand, p->win);
+
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
+
+		printf("Loading hough kernel tables :\n");
+		setArg(b->houghKer, 1, sizeof(cl_mem), &p->cosBuf, "Cosinus table");
+		setArg(b->houghKer, 2, sizeof(cl_mem), &p->sinBuf, "Sinus table");
+		setArg(b->houghKer, 7, sizeof(int), &p->phiDim, "Dicrete step phi");
+
+		setArg(b->houghSwiKer, 1, sizeof(cl_mem), &p->cosBuf,
+			"Cosinus table");
+		setArg(b->houghSwiKer, 2, sizeof(cl_mem), &p->sinBuf, "Sinus table");
+		setArg(b->houghSwiKer, 7, sizeof(int), &p->phiDim,
+			"Dicrete step phi");
+
+		setArg(b->houghOrientKer, 2, sizeof(cl_mem), &p->cosBuf,
+			"Cosinus table");
+		setArg(b->houghOrientKer, 3, sizeof(cl_mem), &p->sinBuf,
+			"Sinus table");
+		setArg(b->houghOrientKer, 8, sizeof(int), &p->phiDim,
+			"Dicrete step phi");
+		setArg(b->houghOrientKer, 10, sizeof(int), &p->phiWin, "Phi window");
+
+		setArg(b->houghListKer, 2, sizeof(cl_mem), &p->cosBuf,
+			"Cosinus table");
+		setArg(b->houghListKer, 3, sizeof(cl_mem), &p->sinBuf, "Sinus table");
+		setArg(b->houghListKer, 6, sizeof(int), &p->phiDim,
+			"Dicrete step phi");
+
+		setArg(b->houghOrientListKer, 3, sizeof(cl_mem), &p->cosBuf,
+			"Cosinus table");
+		setArg(b->houghOrientListKer, 4, sizeof(cl_mem), &p->sinBuf,
+			"Sinus table");
+		setArg(b->houghOrientListKer, 8, sizeof(int), &p->phiDim,
+			"Dicrete step phi");
+		setArg(b->houghOrientListKer, 10, sizeof(int), &p->phiWin,
+			"Phi window");
+
+		setArg(b->houghKer, 9, p->phiBand * p->win * sizeof(int), NULL,
+			"Local accumulator");
+		setArg(b->houghKer, 10, sizeof(int), &p->phiBand, "Phi band");
+		setArg(b->houghKer, 11, sizeof(int), &p->win, "R window");
+
+		int stepPhi = HOUGH_COARSE_PHI;
+		int stepR = HOUGH_COARSE_R;
+		setArg(b->coarseKer, 1, sizeof(cl_mem), &p->cosBuf, "Cosinus table");
+		setArg(b->coarseKer, 2, sizeof(cl_mem), &p->sinBuf, "Sinus table");
+		setArg(b->coarseKer, 4, sizeof(int), &stepPhi, "Coarse step phi");
+		setArg(b->coarseKer, 5, sizeof(int), &stepR, "Coarse step r");
+		setArg(b->coarseKer, 7, sizeof(int), &p->cPhiDim, "Coarse phiDim");
+		setArg(b->coarseKer, 8, sizeof(int), &p->phiDim, "phiDim");
+
+		setArg(b->refineKer, 1, sizeof(cl_mem), &p->cosBuf, "Cosinus table");
+		setArg(b->refineKer, 2, sizeof(cl_mem), &p->sinBuf, "Sinus table");
+		setArg(b->refineKer, 5, sizeof(int), &p->nbCand, "Candidates");
+		printf("\n");
 	}
 }
 
-void houghLine(	int* sobel, int** houghL, int width, int height,
-		size_t nb_pixel, size_t data_size){
+void pipelineResize(Pipeline* p, int width, int height){
+	// same geometry as last frame, buffers and args are still valid
+	if(p->width == width && p->height == height){
+		return;
+	}
+
+	printf("Resizing pipeline to %d x %d\n", width, height);
+
+	pipelineReleaseBuffers(p);
 
-	float discStepPhi = DISCRETE_PHI;
-	float discStepR = DISCRETE_R;
+	p->width = width;
+	p->height = height;
+	p->nb_pixel = width * height;
+	p->data_size = p->nb_pixel * sizeof(int);
 
 	// dimension of accumaltor
-	int phiDim = (int) (M_PI/ discStepPhi);
-	int rDim = (int) (((width + height) * 2 + 1) / discStepR);
+	p->rDim = houghRDim(width, height, p->discStepR);
+	p->rNeg = houghRNeg(width, p->discStepR);
+	p->accSize = p->phiDim * p->rDim;
+	if(p->houghMode == HOUGH_COARSE){
+		double diagonal = sqrt((double) width * width
+			+ (double) height * height);
+
+		// one more cell for curv
+		p->cRDim = (p->rDim + HOUGH_COARSE_R - 1) / HOUGH_COARSE_R + 1;
+		p->accSize = p->cPhiDim * p->cRDim;
+
+		// r = rho * cos(phi - theta) overshoots the r of the ends of a
+		// cell by at most rho * (1 - cos(cell width))
+		p->curv = (int) (diagonal * (1 - cos((HOUGH_COARSE_PHI - 1)
+			* p->discStepPhi)) / p->discStepR * (1 << HOUGH_FRAC_BITS)) + 1;
+
+		p->winPhi = (2 * HOUGH_REFINE_CELLS + 1) * HOUGH_COARSE_PHI
+			+ 2 * nmsPhi;
+		p->winPhi = p->winPhi < p->phiDim ? p->winPhi : p->phiDim;
+		p->winR = (2 * HOUGH_REFINE_CELLS + 1) * HOUGH_COARSE_R + 2 * nmsR;
+		p->winR = p->winR < p->rDim ? p->winR : p->rDim;
+
+		// r of a pixel moves by at most |phi - mid| * diagonal across the
+		// window, no edge voting in a window is skipped
+		double drift = (p->winPhi / 2 + 1) * p->discStepPhi * diagonal
+			/ p->discStepR;
+		p->rTol = (int) ((p->winR / 2 + 1 + drift)
+			* (1 << HOUGH_FRAC_BITS));
+	}
+	p->accWords = (p->accSize * p->accBytes + sizeof(int) - 1) / sizeof(int);
 
-	rDim_s = rDim;
-	phiDim_s = phiDim;
+	// fixed-point r of the kernels are 32 bits, up to ~10K px diagonals
+	if(sqrt((double) width * width + (double) height * height)
+		/ p->discStepR >= (1u << (31 - HOUGH_FRAC_BITS)) - 1){
+		printf("Image too large for the fixed-point hough\n");
+		exit(1);
+	}
 
-	printf("Accumulator size :  %d\n",rDim_s * phiDim);
+	printf("Accumulator size :  %d, %d bytes\n", p->accSize,
+		p->accWords * (int) sizeof(int));
 
-	int* acc = (int*) malloc(phiDim * rDim * sizeof(int));
-	
-	accumulator_s = phiDim * rDim;
+	if(p->nbBands > 1 || p->houghMode == HOUGH_COARSE){
+		p->partAcc = (unsigned char*) malloc((size_t) p->nbBands
+			* p->accSize * p->accBytes);
+		if(p->partAcc == NULL){
+			printf("Failed memory allocation\n");
+			exit(1);
+		}
+	}
+
+	int halo = p->edgeMode == EDGE_CANNY ? CANNY_HALO : 1;
+
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
+
+		// even split of the rows, halos where there is a neighbour band
+		b->y0 = height * i / p->nbBands;
+		b->rows = height * (i + 1) / p->nbBands - b->y0;
+		b->haloTop = b->y0 < halo ? b->y0 : halo;
+		b->yOffset = b->y0 - b->haloTop;
+		int haloBottom = height - b->y0 - b->rows;
+		haloBottom = haloBottom < halo ? haloBottom : halo;
+		b->bufRows = b->rows + b->haloTop + haloBottom;
+		b->totPx = b->bufRows * width;
+
+		printf("Band %d : rows %d to %d\n", i, b->y0, b->y0 + b->rows - 1);
+
+		// create buffers
+		b->rgba = 	createRBuffer(context, (size_t) b->totPx * 4, NULL);
+		b->grey = 	createWRBuffer(context, b->totPx, NULL);
+		b->edges = 	createWRBuffer(context, b->totPx * sizeof(int), NULL);
+		if(p->houghMode == HOUGH_ORIENTED){
+			b->dirs = createWRBuffer(context, b->totPx * sizeof(short), NULL);
+		}
+		b->acc = 	createWRBuffer(context, p->accWords * sizeof(int), NULL);
+		if(p->houghMode == HOUGH_COARSE){
+			b->cand = createRBuffer(context, 2 * p->nbCand * sizeof(int),
+				NULL);
+			b->refineAcc = createWRBuffer(context, (size_t) p->nbCand
+				* p->winPhi * p->winR * sizeof(int), NULL);
+		}else if(p->nbBands == 1){
+			// the first step of topLines has the most pairs
+			size_t nbPairs = (size_t) (p->accSize + TOPK_TILE - 1)
+				/ TOPK_TILE * NB_LINES;
+			for(int k = 0; k < 2; k++){
+				b->topVotes[k] = createWRBuffer(context,
+					nbPairs * sizeof(int), NULL);
+				b->topBins[k] = createWRBuffer(context, nbPairs * sizeof(int),
+					NULL);
+			}
+		}
+		if(p->edgeMode == EDGE_CANNY){
+			b->blur = createWRBuffer(context, b->totPx, NULL);
+			b->mag = createWRBuffer(context, b->totPx * sizeof(short), NULL);
+			b->sector = createWRBuffer(context, b->totPx, NULL);
+			b->state = createWRBuffer(context, b->totPx, NULL);
+		}
+		if(p->compact){
+			// every pixel may be an edge, packed x and y fit 16 bits each
+			b->edgeList = createWRBuffer(context,
+				b->totPx * sizeof(unsigned int), NULL);
+			b->edgeVals = createWRBuffer(context, b->totPx, NULL);
+			b->edgeCount = createWRBuffer(context, sizeof(int), NULL);
+			b->listHost = (unsigned int*) malloc(b->totPx
+				* sizeof(unsigned int));
+			b->valsHost = (unsigned char*) malloc(b->totPx);
+			if(b->listHost == NULL || b->valsHost == NULL){
+				printf("Failed memory allocation\n");
+				exit(1);
+			}
+		}
 
-	// pre compute cos and sin
-	float *tabSin, *tabCos;
+		// bind every argument depending on the geometry once
+		printf("Loading kernel args :\n");
+		setArg(b->greyKer, 0, sizeof(cl_mem), &b->rgba, "RGBA");
+		setArg(b->greyKer, 1, sizeof(cl_mem), &b->grey, "grey");
+
+		setArg(b->sobelKer, 0, sizeof(cl_mem), &b->grey, "Grey shades");
+		setArg(b->sobelKer, 1, sizeof(int), &p->width, "width");
+		setArg(b->sobelKer, 2, sizeof(int), &b->totPx, "total pixels");
+		setArg(b->sobelKer, 3, sizeof(cl_mem), &b->edges, "Sobel buffer");
+
+		setArg(b->sobelTiledKer, 0, sizeof(cl_mem), &b->grey, "Grey shades");
+		setArg(b->sobelTiledKer, 1, sizeof(int), &p->width, "width");
+		setArg(b->sobelTiledKer, 2, sizeof(int), &b->bufRows, "height");
+		setArg(b->sobelTiledKer, 3, sizeof(cl_mem), &b->edges,
+			"Sobel buffer");
+
+		setArg(b->sobelSepKer, 0, sizeof(cl_mem), &b->grey, "Grey shades");
+		setArg(b->sobelSepKer, 1, sizeof(int), &p->width, "width");
+		setArg(b->sobelSepKer, 2, sizeof(int), &b->bufRows, "height");
+		setArg(b->sobelSepKer, 3, sizeof(cl_mem), &b->edges, "Sobel buffer");
+
+		setArg(b->greySobelKer, 0, sizeof(cl_mem), &b->rgba, "RGBA");
+		setArg(b->greySobelKer, 1, sizeof(int), &p->width, "width");
+		setArg(b->greySobelKer, 2, sizeof(int), &b->bufRows, "height");
+		setArg(b->greySobelKer, 3, sizeof(cl_mem), &b->edges, "Sobel buffer");
+
+		setArg(b->sobelSwiKer, 0, sizeof(cl_mem), &b->grey, "Grey shades");
+		setArg(b->sobelSwiKer, 1, sizeof(int), &p->width, "width");
+		setArg(b->sobelSwiKer, 2, sizeof(int), &b->bufRows, "height");
+		setArg(b->sobelSwiKer, 3, sizeof(cl_mem), &b->edges, "Sobel buffer");
+
+		// gradient directions, a NULL buffer tells the kernels to skip them
+		cl_kernel sobelKers[] = {b->sobelKer, b->sobelTiledKer,
+			b->sobelSepKer, b->greySobelKer, b->sobelSwiKer};
+		for(int k = 0; k < NB_SOBEL_MODES; k++){
+			setArg(sobelKers[k], 4, sizeof(cl_mem), &b->dirs, "Directions");
+			setArg(sobelKers[k], 5, sizeof(float), &p->discStepPhi,
+				"Discrete step phi");
+			setArg(sobelKers[k], 6, sizeof(int), &p->phiDim, "phiDim");
+		}
 
-	tabSin = (float*) malloc(phiDim * sizeof(float));
-	tabCos = (float*) malloc(phiDim * sizeof(float));
+		setArg(b->houghKer, 0, sizeof(cl_mem), &b->edges, "Edge image");
+		setArg(b->houghKer, 3, sizeof(int), &p->width, "Width");
+		setArg(b->houghKer, 4, sizeof(int), &b->bufRows, "Height");
+		setArg(b->houghKer, 5, sizeof(int), &p->rDim, "rDim");
+		setArg(b->houghKer, 6, sizeof(int), &p->rNeg, "Negative r");
+		setArg(b->houghKer, 8, sizeof(cl_mem), &b->acc, "Accumulator");
+		setArg(b->houghKer, 12, sizeof(int), &b->yOffset, "Row offset");
+
+		setArg(b->houghSwiKer, 0, sizeof(cl_mem), &b->edges, "Edge image");
+		setArg(b->houghSwiKer, 3, sizeof(int), &p->width, "Width");
+		setArg(b->houghSwiKer, 4, sizeof(int), &b->bufRows, "Height");
+		setArg(b->houghSwiKer, 5, sizeof(int), &p->rDim, "rDim");
+		setArg(b->houghSwiKer, 6, sizeof(int), &p->rNeg, "Negative r");
+		setArg(b->houghSwiKer, 8, sizeof(cl_mem), &b->acc, "Accumulator");
+		setArg(b->houghSwiKer, 9, sizeof(int), &b->yOffset, "Row offset");
+
+		setArg(b->houghOrientKer, 0, sizeof(cl_mem), &b->edges, "Edge image");
+		setArg(b->houghOrientKer, 1, sizeof(cl_mem), &b->dirs, "Directions");
+		setArg(b->houghOrientKer, 4, sizeof(int), &p->width, "Width");
+		setArg(b->houghOrientKer, 5, sizeof(int), &b->bufRows, "Height");
+		setArg(b->houghOrientKer, 6, sizeof(int), &p->rDim, "rDim");
+		setArg(b->houghOrientKer, 7, sizeof(int), &p->rNeg, "Negative r");
+		setArg(b->houghOrientKer, 9, sizeof(cl_mem), &b->acc, "Accumulator");
+		setArg(b->houghOrientKer, 11, sizeof(int), &b->yOffset, "Row offset");
+
+		setArg(b->clearKer, 0, sizeof(cl_mem), &b->acc, "Clear accumulator");
+
+		if(p->houghMode == HOUGH_COARSE){
+			setArg(b->coarseKer, 0, sizeof(cl_mem), &b->edges, "Edge image");
+			setArg(b->coarseKer, 3, sizeof(int), &p->width, "Width");
+			setArg(b->coarseKer, 6, sizeof(int), &p->cRDim, "Coarse rDim");
+			setArg(b->coarseKer, 9, sizeof(int), &p->rNeg, "Negative r");
+			setArg(b->coarseKer, 10, sizeof(int), &p->curv, "Curvature");
+			setArg(b->coarseKer, 11, sizeof(cl_mem), &b->acc, "Accumulator");
+			setArg(b->coarseKer, 12, sizeof(int), &b->yOffset, "Row offset");
+
+			setArg(b->refineKer, 0, sizeof(cl_mem), &b->edges, "Edge image");
+			setArg(b->refineKer, 3, sizeof(int), &p->width, "Width");
+			setArg(b->refineKer, 4, sizeof(cl_mem), &b->cand, "Candidates");
+			setArg(b->refineKer, 6, sizeof(int), &p->winPhi, "Window phi");
+			setArg(b->refineKer, 7, sizeof(int), &p->winR, "Window r");
+			setArg(b->refineKer, 8, sizeof(int), &p->rTol, "R tolerance");
+			setArg(b->refineKer, 9, sizeof(cl_mem), &b->refineAcc,
+				"Refined votes");
+			setArg(b->refineKer, 10, sizeof(int), &b->yOffset, "Row offset");
+
+			setArg(b->clearRefineKer, 0, sizeof(cl_mem), &b->refineAcc,
+				"Clear refined votes");
+		}
 
-	if(tabSin == NULL || tabCos == NULL){
-		printf("Failed memory allocation\n");
-		exit(1);
+		if(p->edgeMode == EDGE_CANNY){
+			int first = b->haloTop;
+			int last = b->haloTop + b->rows;
+
+			setArg(b->cannyBlurKer, 0, sizeof(cl_mem), &b->grey,
+				"Grey shades");
+			setArg(b->cannyBlurKer, 1, sizeof(int), &p->width, "width");
+			setArg(b->cannyBlurKer, 2, sizeof(int), &b->bufRows, "height");
+			setArg(b->cannyBlurKer, 3, sizeof(cl_mem), &b->blur, "Blurred");
+
+			setArg(b->cannyGradKer, 0, sizeof(cl_mem), &b->blur, "Blurred");
+			setArg(b->cannyGradKer, 1, sizeof(int), &p->width, "width");
+			setArg(b->cannyGradKer, 2, sizeof(int), &b->bufRows, "height");
+			setArg(b->cannyGradKer, 3, sizeof(cl_mem), &b->mag, "Magnitude");
+			setArg(b->cannyGradKer, 4, sizeof(cl_mem), &b->sector,
+				"Sector");
+			setArg(b->cannyGradKer, 5, sizeof(cl_mem), &b->dirs,
+				"Directions");
+			setArg(b->cannyGradKer, 6, sizeof(float), &p->discStepPhi,
+				"Discrete step phi");
+			setArg(b->cannyGradKer, 7, sizeof(int), &p->phiDim, "phiDim");
+
+			setArg(b->cannyNmsKer, 0, sizeof(cl_mem), &b->mag, "Magnitude");
+			setArg(b->cannyNmsKer, 1, sizeof(cl_mem), &b->sector, "Sector");
+			setArg(b->cannyNmsKer, 2, sizeof(int), &p->width, "width");
+			setArg(b->cannyNmsKer, 3, sizeof(int), &b->bufRows, "height");
+			setArg(b->cannyNmsKer, 4, sizeof(cl_mem), &b->state, "State");
+
+			setArg(b->cannyHystKer, 0, sizeof(cl_mem), &b->state, "State");
+			setArg(b->cannyHystKer, 1, sizeof(int), &p->width, "width");
+			setArg(b->cannyHystKer, 2, sizeof(int), &b->bufRows, "height");
+
+			setArg(b->cannyEdgesKer, 0, sizeof(cl_mem), &b->state, "State");
+			setArg(b->cannyEdgesKer, 1, sizeof(cl_mem), &b->mag,
+				"Magnitude");
+			setArg(b->cannyEdgesKer, 2, sizeof(int), &p->width, "width");
+			setArg(b->cannyEdgesKer, 3, sizeof(int), &first, "First row");
+			setArg(b->cannyEdgesKer, 4, sizeof(int), &last, "Last row");
+			setArg(b->cannyEdgesKer, 5, sizeof(cl_mem), &b->edges,
+				"Edge image");
+		}
+
+		if(p->compact){
+			setArg(b->compactKer, 0, sizeof(cl_mem), &b->edges, "Edge image");
+			setArg(b->compactKer, 1, sizeof(int), &p->width, "width");
+			setArg(b->compactKer, 2, sizeof(int), &b->totPx, "total pixels");
+			setArg(b->compactKer, 3, sizeof(cl_mem), &b->edgeList,
+				"Edge list");
+			setArg(b->compactKer, 4, sizeof(cl_mem), &b->edgeVals,
+				"Edge values");
+			setArg(b->compactKer, 5, sizeof(cl_mem), &b->edgeCount,
+				"Edge count");
+
+			setArg(b->clearCountKer, 0, sizeof(cl_mem), &b->edgeCount,
+				"Clear edge count");
+
+			setArg(b->houghListKer, 0, sizeof(cl_mem), &b->edgeList,
+				"Edge list");
+			setArg(b->houghListKer, 1, sizeof(cl_mem), &b->edgeCount,
+				"Edge count");
+			setArg(b->houghListKer, 4, sizeof(int), &p->rDim, "rDim");
+			setArg(b->houghListKer, 5, sizeof(int), &p->rNeg, "Negative r");
+			setArg(b->houghListKer, 7, sizeof(cl_mem), &b->acc,
+				"Accumulator");
+			setArg(b->houghListKer, 8, sizeof(int), &b->yOffset,
+				"Row offset");
+
+			setArg(b->houghOrientListKer, 0, sizeof(cl_mem), &b->edgeList,
+				"Edge list");
+			setArg(b->houghOrientListKer, 1, sizeof(cl_mem), &b->edgeCount,
+				"Edge count");
+			setArg(b->houghOrientListKer, 2, sizeof(cl_mem), &b->dirs,
+				"Directions");
+			setArg(b->houghOrientListKer, 5, sizeof(int), &p->width, "Width");
+			setArg(b->houghOrientListKer, 6, sizeof(int), &p->rDim, "rDim");
+			setArg(b->houghOrientListKer, 7, sizeof(int), &p->rNeg,
+				"Negative r");
+			setArg(b->houghOrientListKer, 9, sizeof(cl_mem), &b->acc,
+				"Accumulator");
+			setArg(b->houghOrientListKer, 11, sizeof(int), &b->yOffset,
+				"Row offset");
+		}
+		printf("\n");
 	}
+}
 
-	float invR = 1.0/discStepR;
+void pipelineReleaseBuffers(Pipeline* p){
+	for(int i = 0; i < p->nbBands; i++){
+		releaseBuffer(&p->bands[i].rgba);
+		releaseBuffer(&p->bands[i].grey);
+		releaseBuffer(&p->bands[i].edges);
+		releaseBuffer(&p->bands[i].dirs);
+		releaseBuffer(&p->bands[i].acc);
+		releaseBuffer(&p->bands[i].blur);
+		releaseBuffer(&p->bands[i].mag);
+		releaseBuffer(&p->bands[i].sector);
+		releaseBuffer(&p->bands[i].state);
+		releaseBuffer(&p->bands[i].edgeList);
+		releaseBuffer(&p->bands[i].edgeVals);
+		releaseBuffer(&p->bands[i].edgeCount);
+		releaseBuffer(&p->bands[i].cand);
+		releaseBuffer(&p->bands[i].refineAcc);
+
+		for(int k = 0; k < 2; k++){
+			releaseBuffer(&p->bands[i].topVotes[k]);
+			releaseBuffer(&p->bands[i].topBins[k]);
+		}
 
-	for(int phi = 0 ; phi < phiDim ; phi++){
-		float phiFloat = phi * discStepPhi;
+		free(p->bands[i].listHost);
+		free(p->bands[i].valsHost);
+		p->bands[i].listHost = NULL;
+		p->bands[i].valsHost = NULL;
+	}
 
-		tabSin[phi] = (float)(sin(phiFloat));
-		tabCos[phi] = (float)(cos(phiFloat));
-	}		
+	free(p->partAcc);
+	p->partAcc = NULL;
 
-	// create buffers
-	cl_mem sinBuf = createRBuffer(context, phiDim * sizeof(float), tabSin);
-	cl_mem cosBuf = createRBuffer(context, phiDim * sizeof(float), tabCos);
-	cl_mem edges = createRBuffer(context, data_size, sobel);
-	cl_mem lines = createWBuffer(context, phiDim * rDim * sizeof(int),NULL);  
+	p->width = 0;
+	p->height = 0;
+}
 
-	// create kernel
-	cl_kernel houghLineKer =  createKernel(program, "houghLine");
-	size_t globalWorkSize[1];	
-	globalWorkSize[0] = nb_pixel;
+void pipelineRelease(Pipeline* p){
+	pipelineReleaseBuffers(p);
+
+	releaseBuffer(&p->sinBuf);
+	releaseBuffer(&p->cosBuf);
+
+	for(int b = 0; b < p->nbBands; b++){
+		Band* band = &p->bands[b];
+		cl_kernel* kers[] = {&band->greyKer, &band->sobelKer,
+			&band->sobelTiledKer, &band->sobelSepKer, &band->greySobelKer,
+			&band->sobelSwiKer,
+			&band->houghKer, &band->houghSwiKer, &band->houghOrientKer,
+			&band->clearKer, &band->compactKer, &band->clearCountKer,
+			&band->houghListKer, &band->houghOrientListKer,
+			&band->cannyBlurKer, &band->cannyGradKer, &band->cannyNmsKer,
+			&band->cannyHystKer, &band->cannyEdgesKer, &band->topKer,
+			&band->coarseKer, &band->refineKer, &band->clearRefineKer};
+		for(int i = 0; i < 23; i++){
+			if(*kers[i]){
+				clReleaseKernel(*kers[i]);
+				*kers[i] = NULL;
+			}
+		}
+	}
+}
 
-	//load kernel args
-	printf("Loading kernel args :\n");
-	printf("Edge image, ");	
-	status = clSetKernelArg(houghLineKer, 0, sizeof(cl_mem), &edges);
-	checkErr(status, "Failed loading kernel args");
+/**
+ * Each stage reads and writes the pipeline device buffers so the next one
+ * can use them directly, the host copy is only made when ret != NULL.
+ * Commands of every band are only enqueued, the devices run side by side
+ * until houghLine waits for the accumulators.
+ */
+void blackAndWhite(Pipeline* p, png_bytep pixels, unsigned char** ret){
+	unsigned char *img = NULL;
+
+	if(ret != NULL){
+		img = (unsigned char*)malloc(p->nb_pixel);
+		*ret = img;
+	}
 
-	printf("Cosinus table, ");
-	status = clSetKernelArg(houghLineKer, 1, sizeof(cl_mem), &cosBuf);
-	checkErr(status, "Failed loading kernel args");
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
+
+		// libpng RGBA rows are contiguous, uploaded as is (uchar4 per
+		// pixel), halo rows included. pixels outlive the frame commands.
+		printf("Uploading RGBA : ");
+		status = clEnqueueWriteBuffer(
+			b->queue, b->rgba, CL_FALSE, 0, (size_t) b->totPx * 4,
+			pixels + (size_t) b->yOffset * p->width * 4, 0, NULL,
+			profEvent("upload_rgba", "transfer", i));
+		checkErr(status, "Failed writing buffer");
+
+		// greySobel converts on the fly, the grey image is only made
+		// when someone reads it
+		if(p->sobelMode == SOBEL_FUSED && p->edgeMode == EDGE_SOBEL
+			&& ret == NULL && benchIters == 0){
+			continue;
+		}
 
-	printf("Sinus table, ");
-	status = clSetKernelArg(houghLineKer, 2, sizeof(cl_mem), &sinBuf);
-	checkErr(status, "Failed loading kernel args");
+		size_t globalWorkSize[1];	
+		globalWorkSize[0] = b->totPx;
+
+		// Executing kernel
+		printf("Executing kernel : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, b->greyKer, 1, NULL, globalWorkSize, NULL, 0, NULL,
+			profEvent("grey_shade", "kernel", i));
+		checkErr(status, "Failed executing kernel");
+
+		// Reading results only if the host needs them
+		if(ret != NULL){
+			readBuffer(b->queue, b->grey, (size_t) b->haloTop * p->width,
+				(size_t) b->rows * p->width, img + (size_t) b->y0 * p->width,
+				profEvent("read_grey", "transfer", i));
+		}
+	}
+}
 
-	printf("Width, ");
-	status = clSetKernelArg(houghLineKer, 3, sizeof(int), &width);
-	checkErr(status, "Failed loading kernel args");
+void edgeD(Pipeline* p, int** sobel){
+	int* edgeImg = NULL;
 
-	printf("rDim, ");
-	status = clSetKernelArg(houghLineKer, 4, sizeof(int), &rDim);
-	checkErr(status, "Failed loading kernel args");
+	if(sobel != NULL){
+		edgeImg = (int*) malloc(p->data_size);
+		*sobel = edgeImg;
+	}
 
-	printf("Dicrete step phi, ");
-	status = clSetKernelArg(houghLineKer, 5, sizeof(int), &phiDim);
-	checkErr(status, "Failed loading kernel args");
+	// the line buffer of sobelSWI only holds SOBEL_SWI_WIDTH pixel rows
+	int mode = p->sobelMode;
+	if(mode == SOBEL_SWI && p->width > SOBEL_SWI_WIDTH){
+		printf("Image wider than %d, sobelSWI replaced by sobelTiled\n",
+			SOBEL_SWI_WIDTH);
+		mode = SOBEL_TILED;
+	}
 
-	printf("Discrete step r, ");
-	status = clSetKernelArg(houghLineKer, 6, sizeof(float), &discStepR);
-	checkErr(status, "Failed loading kernel args");
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
 
-	printf("Accumulator, ");
-	status = clSetKernelArg(houghLineKer, 7, sizeof(cl_mem), &lines);
-	checkErr(status, "Failed loading kernel args");
+		const char* names[NB_SOBEL_MODES] = {"sobel", "sobelTiled",
+			"sobelSeparable", "greySobel", "sobelSWI"};
+		if(p->edgeMode == EDGE_CANNY){
+			enqueueCanny(p, b, i);
+		}else{
+			enqueueSobel(p, b, mode, profEvent(names[mode], "kernel", i));
+		}
+
+		// dense list of the edges, only its count comes back now, the
+		// list itself is read by readEdgeList once hough is done
+		if(p->compact){
+			size_t countGlobal[1] = {1};
+			size_t compactGlobal[1];
+			size_t compactLocal[1] = {COMPACT_GROUP};
+			compactGlobal[0] = (b->totPx + COMPACT_GROUP - 1) / COMPACT_GROUP
+				* COMPACT_GROUP;
+
+			printf("Clearing edge count : ");
+			status = clEnqueueNDRangeKernel(
+				b->queue, b->clearCountKer, 1, NULL, countGlobal, NULL, 0,
+				NULL, profEvent("clear_count", "kernel", i));
+			checkErr(status, "Failed executing kernel");
+
+			printf("Executing kernel : ");
+			status = clEnqueueNDRangeKernel(
+				b->queue, b->compactKer, 1, NULL, compactGlobal, compactLocal,
+				0, NULL, profEvent("compactEdges", "kernel", i));
+			checkErr(status, "Failed executing kernel");
+
+			readBuffer(b->queue, b->edgeCount, 0, sizeof(int), &b->nbEdges,
+				profEvent("read_count", "transfer", i));
+		}
+
+		// owned rows only, the halos belong to the neighbour bands
+		if(sobel != NULL){
+			readBuffer(b->queue, b->edges,
+				(size_t) b->haloTop * p->width * sizeof(int),
+				(size_t) b->rows * p->width * sizeof(int),
+				edgeImg + (size_t) b->y0 * p->width,
+				profEvent("read_edges", "transfer", i));
+		}
+	}
+}
+
+// sobel of band b with the kernel of the given mode
+void enqueueSobel(Pipeline* p, Band* b, int mode, cl_event* ev){
+	if(mode == SOBEL_TILED || mode == SOBEL_FUSED){
+		// one work-group per tile, band rounded up to whole tiles
+		size_t sobelGlobal[2];
+		size_t sobelLocal[2] = {SOBEL_TILE, SOBEL_TILE};
+		sobelGlobal[0] = (p->width + SOBEL_TILE - 1) / SOBEL_TILE * SOBEL_TILE;
+		sobelGlobal[1] = (b->bufRows + SOBEL_TILE - 1) / SOBEL_TILE
+			* SOBEL_TILE;
+
+		printf("Executing kernel : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, mode == SOBEL_FUSED ? b->greySobelKer : b->sobelTiledKer,
+			2, NULL, sobelGlobal, sobelLocal, 0, NULL, ev);
+	}else if(mode == SOBEL_SEPARABLE){
+		// SOBEL_VEC pixels per work-item along the rows
+		size_t sobelGlobal[2];
+		sobelGlobal[0] = (p->width + SOBEL_VEC - 1) / SOBEL_VEC;
+		sobelGlobal[1] = b->bufRows;
+
+		printf("Executing kernel : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, b->sobelSepKer, 2, NULL, sobelGlobal, NULL, 0, NULL,
+			ev);
+	}else if(mode == SOBEL_SWI){
+		// whole band streamed by a single work-item
+		printf("Executing single work-item kernel : ");
+		status = clEnqueueTask(b->queue, b->sobelSwiKer, 0, NULL, ev);
+	}else{
+		size_t globalWorkSize[1];	
+		globalWorkSize[0] = b->totPx;
+
+		// Executing kernel
+		printf("Executing kernel : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, b->sobelKer, 1,NULL, globalWorkSize, NULL, 0, NULL, ev);
+	}
+	checkErr(status, "Failed executing kernel");
+}
+
+/**
+ * Canny edges of band b : blur, gradient, non-maximum suppression, then
+ * CANNY_HYST_PASSES hysteresis passes. Edges are one pixel wide, far
+ * fewer pixels vote than with the thresholded sobel. Weak chains crossing
+ * a band boundary are followed CANNY_HYST_PASSES rows into the halo.
+ */
+void enqueueCanny(Pipeline* p, Band* b, int dev){
+	size_t globalWorkSize[2];
+	globalWorkSize[0] = p->width;
+	globalWorkSize[1] = b->bufRows;
+
+	cl_kernel kers[] = {b->cannyBlurKer, b->cannyGradKer, b->cannyNmsKer};
+	const char* names[] = {"cannyBlur", "cannyGradient", "cannyNMS"};
+	for(int k = 0; k < 3; k++){
+		printf("Executing kernel : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, kers[k], 2, NULL, globalWorkSize, NULL, 0, NULL,
+			profEvent(names[k], "kernel", dev));
+		checkErr(status, "Failed executing kernel");
+	}
+
+	// only the first pass is profiled, they all cost the same
+	for(int pass = 0; pass < CANNY_HYST_PASSES; pass++){
+		printf("Executing kernel : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, b->cannyHystKer, 2, NULL, globalWorkSize, NULL, 0, NULL,
+			pass == 0 ? profEvent("cannyHysteresis", "kernel", dev) : NULL);
+		checkErr(status, "Failed executing kernel");
+	}
+
+	size_t edgesGlobal[1];
+	edgesGlobal[0] = b->totPx;
 
-	// Executing kernel
 	printf("Executing kernel : ");
 	status = clEnqueueNDRangeKernel(
-		queue, houghLineKer,1, NULL,globalWorkSize,NULL, 0, NULL, NULL);
+		b->queue, b->cannyEdgesKer, 1, NULL, edgesGlobal, NULL, 0, NULL,
+		profEvent("cannyEdges", "kernel", dev));
 	checkErr(status, "Failed executing kernel");
+}
 
-	// Read result back
-	printf("Reading results : ");
-	status = clEnqueueReadBuffer(
-	queue, lines, CL_TRUE, 0, phiDim * rDim * sizeof(int), acc,0,NULL,NULL
-	);
-	checkErr(status, "Failed reading results");
-	
-	// Assign acc for return value
+/**
+ * Runs every sobel kernel iters times on the current grey image (-B) and
+ * prints its mean time next to its cost per pixel : bytes loaded and
+ * add / shift operations counted from the kernel code. The compulsory
+ * traffic (1 byte in, 4 bytes out per pixel) gives the bandwidth.
+ * fused also does the grey conversion, compare it to grey_shade + tiled.
+ * swi is skipped on images wider than its line buffer.
+ * The edge buffer is overwritten, edgeD runs afterward as usual.
+ */
+void benchSobel(Pipeline* p, int iters){
+	const char* names[NB_SOBEL_MODES] = {"basic", "tiled", "separable",
+		"fused", "swi"};
+	// basic : 9 loads and 2 x 7 terms per pixel. tiled : 18 x 18 loads per
+	// 16 x 16 tile. separable : 3 rows x 16 bytes per 8 pixels, 4 ops per
+	// column for 10 columns and 5 per pixel for 8 pixels. fused : tiled
+	// on RGBA, 3 more ops per loaded pixel. swi : one load per pixel
+	float loads[NB_SOBEL_MODES] = {9.0f, 18.0f * 18 / 256, 3.0f * 16 / 8,
+		4.0f * 18 * 18 / 256, 1.0f};
+	float ops[NB_SOBEL_MODES] = {15.0f, 15.0f, (4.0f * 10 + 5 * 8) / 8,
+		15.0f + 3.0f * 18 * 18 / 256, 15.0f};
+
+	for(int mode = 0; mode < NB_SOBEL_MODES; mode++){
+		cl_ulong total = 0;
+
+		if(mode == SOBEL_SWI && p->width > SOBEL_SWI_WIDTH){
+			continue;
+		}
+
+		for(int it = 0; it < iters; it++){
+			for(int i = 0; i < p->nbBands; i++){
+				cl_event ev;
+				cl_ulong t0, t1;
+
+				enqueueSobel(p, &p->bands[i], mode, &ev);
+				clWaitForEvents(1, &ev);
+				clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+					sizeof(cl_ulong), &t0, NULL);
+				clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+					sizeof(cl_ulong), &t1, NULL);
+				clReleaseEvent(ev);
+				total += t1 - t0;
+			}
+		}
+
+		double ms = total / 1e6 / iters;
+		printf("Bench sobel %-10s : %8.3f ms, %8.1f Mpx/s, %6.2f GB/s,"
+			" %5.2f B/px in, %5.2f ops/px\n", names[mode], ms,
+			p->nb_pixel / ms / 1e3, p->nb_pixel * 5.0 / ms / 1e6,
+			loads[mode], ops[mode]);
+	}
+}
+
+void houghLine(Pipeline* p, int** houghL){
+
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
+		size_t globalWorkSize[1];	
+
+		// votes are accumulated, reset the previous frame ones on the device
+		printf("Clearing accumulator : ");
+		globalWorkSize[0] = p->accWords;
+		status = clEnqueueNDRangeKernel(
+			b->queue, b->clearKer, 1, NULL, globalWorkSize, NULL, 0, NULL,
+			profEvent("clear_acc", "kernel", i));
+		checkErr(status, "Failed executing kernel");
+
+		if(p->houghMode == HOUGH_SWI){
+			// whole band swept by a single work-item
+			printf("Executing single work-item kernel : ");
+			status = clEnqueueTask(b->queue, b->houghSwiKer, 0, NULL,
+				profEvent("houghLineSWI", "kernel", i));
+			checkErr(status, "Failed executing kernel");
+		}else if(p->houghMode == HOUGH_COARSE){
+			// one work-item per pixel of the band, in the coarse cells
+			size_t coarseGlobal[2];
+			coarseGlobal[0] = p->width;
+			coarseGlobal[1] = b->bufRows;
+
+			printf("Executing kernel : ");
+			status = clEnqueueNDRangeKernel(
+				b->queue, b->coarseKer, 2, NULL, coarseGlobal, NULL, 0,
+				NULL, profEvent("houghLineCoarse", "kernel", i));
+			checkErr(status, "Failed executing kernel");
+		}else if(p->compact){
+			// fixed NDRange walking the edge list of the band
+			size_t listGlobal[1] = {HOUGH_LIST_ITEMS};
+			bool oriented = p->houghMode == HOUGH_ORIENTED;
+
+			printf("Executing kernel : ");
+			status = clEnqueueNDRangeKernel(
+				b->queue, oriented ? b->houghOrientListKer : b->houghListKer,
+				1, NULL, listGlobal, NULL, 0, NULL,
+				profEvent(oriented ? "houghLineOrientedList" : "houghLineList",
+				"kernel", i));
+			checkErr(status, "Failed executing kernel");
+		}else if(p->houghMode == HOUGH_ORIENTED){
+			// one work-item per pixel of the band
+			size_t houghGlobal[2];
+			houghGlobal[0] = p->width;
+			houghGlobal[1] = b->bufRows;
+
+			printf("Executing kernel : ");
+			status = clEnqueueNDRangeKernel(
+				b->queue, b->houghOrientKer, 2, NULL, houghGlobal, NULL, 0,
+				NULL, profEvent("houghLineOriented", "kernel", i));
+			checkErr(status, "Failed executing kernel");
+		}else{
+			// one work-group per tile, band rounded up to whole tiles
+			size_t houghGlobal[2];
+			size_t houghLocal[2] = {HOUGH_TILE, HOUGH_TILE};
+			houghGlobal[0] = (p->width + HOUGH_TILE - 1) / HOUGH_TILE
+				* HOUGH_TILE;
+			houghGlobal[1] = (b->bufRows + HOUGH_TILE - 1) / HOUGH_TILE
+				* HOUGH_TILE;
+
+			// Executing kernel
+			printf("Executing kernel : ");
+			status = clEnqueueNDRangeKernel(
+				b->queue, b->houghKer, 2, NULL, houghGlobal, houghLocal, 0,
+				NULL, profEvent("houghLine", "kernel", i));
+			checkErr(status, "Failed executing kernel");
+		}
+	}
+
+	if(houghL == NULL){
+		return;
+	}
+
+	// counters of every band next to each other in partAcc, widened and
+	// summed in the result
+	size_t partSize = (size_t) p->accSize * p->accBytes;
+	int* acc = (int*) calloc(p->accSize, sizeof(int));
+	if(acc == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
+	for(int i = 0; i < p->nbBands; i++){
+		readBuffer(p->bands[i].queue, p->bands[i].acc, 0, partSize,
+			p->partAcc + i * partSize, profEvent("read_acc", "transfer", i));
+	}
+
+	// start every device before waiting on any of them
+	for(int i = 0; i < p->nbBands; i++){
+		clFlush(p->bands[i].queue);
+	}
+	for(int i = 0; i < p->nbBands; i++){
+		status = clFinish(p->bands[i].queue);
+		checkErr(status, "Failed waiting for the queue");
+	}
+
+	// sum of the partial accumulators
+	for(int i = 0; i < p->nbBands; i++){
+		if(p->accBytes == sizeof(short)){
+			unsigned short* part = (unsigned short*) (p->partAcc
+				+ i * partSize);
+			for(int j = 0; j < p->accSize; j++){
+				acc[j] += part[j];
+			}
+		}else{
+			int* part = (int*) (p->partAcc + i * partSize);
+			for(int j = 0; j < p->accSize; j++){
+				acc[j] += part[j];
+			}
+		}
+	}
 	*houghL = acc;
-	
-	// cleanup
-	free(tabSin);
-	free(tabCos);	
-	
-	if(sinBuf){
-		clReleaseMemObject(sinBuf);
-		sinBuf = NULL;
+}
+
+/**
+ * Edge image of the frame rebuilt from the compacted lists (-c) : only
+ * 5 bytes per edge cross the bus instead of 4 per pixel. The counts were
+ * read by edgeD, houghLine waited for them.
+ */
+void readEdgeList(Pipeline* p, int** sobel){
+	int* edgeImg = (int*) calloc(p->nb_pixel, sizeof(int));
+	if(edgeImg == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
+	*sobel = edgeImg;
+
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
+
+		if(b->nbEdges == 0){
+			continue;
+		}
+		readBuffer(b->queue, b->edgeList, 0,
+			b->nbEdges * sizeof(unsigned int), b->listHost,
+			profEvent("read_edge_list", "transfer", i));
+		readBuffer(b->queue, b->edgeVals, 0, b->nbEdges, b->valsHost,
+			profEvent("read_edge_vals", "transfer", i));
+		clFlush(b->queue);
+	}
+
+	for(int i = 0; i < p->nbBands; i++){
+		status = clFinish(p->bands[i].queue);
+		checkErr(status, "Failed waiting for the queue");
+	}
+
+	cl_ulong t0 = hostTime();
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
+
+		for(int e = 0; e < b->nbEdges; e++){
+			int x = b->listHost[e] & 0xFFFF;
+			int y = (b->listHost[e] >> 16) + b->yOffset;
+			edgeImg[(size_t) y * p->width + x] = b->valsHost[e];
+		}
+	}
+	profHost("scatter_edges", t0, hostTime());
+}
+
+/**
+ * findLine on the device for a single band : topVotes keeps the nbLine
+ * best bins of each tile of the accumulator, then of each tile of those
+ * pairs, until one group is left. Only nbLine (votes, bin) pairs are read
+ * back instead of the whole accumulator. Ids come worst first as with
+ * findLine, ties may pick other bins. The first step only keeps the peaks
+ * of the (nmsR, nmsPhi) window, as findLine does. Returns how many lines
+ * have votes, the (0, 0) pairs of tiles that ran out of peaks are dropped.
+ */
+int topLines(Pipeline* p, int nbLine, int** ids){
+	Band* b = &p->bands[0];
+	int n = p->accSize;
+	int step = 0;
+
+	printf("Find the %d most important lines on the device\n", nbLine);
+
+	do{
+		int nbGroups = (n + TOPK_TILE - 1) / TOPK_TILE;
+		cl_mem votes = step == 0 ? b->acc : b->topVotes[(step - 1) % 2];
+		cl_mem bins = step == 0 ? NULL : b->topBins[(step - 1) % 2];
+
+		printf("Loading kernel args : ");
+		setArg(b->topKer, 0, sizeof(cl_mem), &votes, "Votes");
+		setArg(b->topKer, 1, sizeof(cl_mem), &bins, "Bins");
+		setArg(b->topKer, 2, sizeof(int), &n, "Pairs");
+		setArg(b->topKer, 3, sizeof(int), &nbLine, "K");
+		setArg(b->topKer, 4, sizeof(int), &p->rDim, "R dim");
+		setArg(b->topKer, 5, sizeof(int), &nmsR, "NMS r");
+		setArg(b->topKer, 6, sizeof(int), &nmsPhi, "NMS phi");
+		setArg(b->topKer, 7, sizeof(cl_mem), &b->topVotes[step % 2],
+			"Best votes");
+		setArg(b->topKer, 8, sizeof(cl_mem), &b->topBins[step % 2],
+			"Best bins");
+		printf("\n");
+
+		size_t topGlobal[1] = {(size_t) nbGroups * TOPK_GROUP};
+		size_t topLocal[1] = {TOPK_GROUP};
+
+		printf("Executing kernel : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, b->topKer, 1, NULL, topGlobal, topLocal, 0, NULL,
+			profEvent("topVotes", "kernel", 0));
+		checkErr(status, "Failed executing kernel");
+
+		n = nbGroups * nbLine;
+		step++;
+	}while(n > nbLine);
+
+	// best first on the device
+	int* bestVotes = (int*) malloc(nbLine * sizeof(int));
+	int* best = (int*) malloc(nbLine * sizeof(int));
+	int* id = (int*) malloc(nbLine * sizeof(int));
+	if(bestVotes == NULL || best == NULL || id == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
+	}
+
+	readBuffer(b->queue, b->topVotes[(step - 1) % 2], 0,
+		nbLine * sizeof(int), bestVotes,
+		profEvent("read_top_votes", "transfer", 0));
+	readBuffer(b->queue, b->topBins[(step - 1) % 2], 0, nbLine * sizeof(int),
+		best, profEvent("read_top", "transfer", 0));
+	status = clFinish(b->queue);
+	checkErr(status, "Failed waiting for the queue");
+
+	int nb = 0;
+	while(nb < nbLine && bestVotes[nb] > 0){
+		nb++;
+	}
+	for(int i = 0; i < nb; i++){
+		id[i] = best[nb - 1 - i];
+	}
+	free(bestVotes);
+	free(best);
+	*ids = id;
+	return nb;
+}
+
+/**
+ * Coarse-to-fine hough (-H coarse). houghLineCoarse votes in the coarse
+ * accumulator, a cell counts at least the votes of any fine bin it holds.
+ * Its nbCand best peaks (max of their +- 1 cells) are refined by
+ * houghRefine with the edges near them only, in a window of winPhi x winR
+ * fine bins : the +- HOUGH_REFINE_CELLS cells around the peak and the
+ * (nmsPhi, nmsR) bins around them, the weaker lines next to a peak are
+ * refined too. The fine bins of those cells that are the maximum of their
+ * NMS window are lines, the same peaks as findLine on the full accumulator.
+ * Ids are fine bins, worst first as with findLine. Returns how many lines
+ * were found.
+ */
+int houghCoarse(Pipeline* p, int nbLine, int** ids){
+	int winSize = p->winPhi * p->winR;
+	size_t refineSize = (size_t) p->nbCand * winSize;
+	int* coarse;
+
+	houghLine(p, &coarse);
+
+	printf("Refine the %d most important coarse lines\n", p->nbCand);
+
+	int* cells = (int*) malloc(p->nbCand * sizeof(int));
+	int* cand = (int*) calloc(2 * p->nbCand, sizeof(int));
+	int* refine = (int*) calloc(refineSize, sizeof(int));
+	int* part = (int*) malloc(p->nbBands * refineSize * sizeof(int));
+	int* lineVotes = (int*) malloc(refineSize * sizeof(int));
+	int* lineIds = (int*) malloc(refineSize * sizeof(int));
+	int* id = (int*) malloc(nbLine * sizeof(int));
+	if(cells == NULL || cand == NULL || refine == NULL || part == NULL
+		|| lineVotes == NULL || lineIds == NULL || id == NULL){
+		printf("Failed memory allocation\n");
+		exit(1);
 	}
-	if(cosBuf){
-		clReleaseMemObject(cosBuf);
-		cosBuf = NULL;
+
+	// only the cells with votes are refined
+	int nbCells = cpuTopK(coarse, p->cRDim, p->cPhiDim, p->nbCand, 1, 1,
+		cells);
+	free(coarse);
+
+	// first fine (phi, r) of each window, kept inside the fine accumulator
+	for(int k = 0; k < nbCells; k++){
+		int phi0 = (cells[k] / p->cRDim - HOUGH_REFINE_CELLS)
+			* HOUGH_COARSE_PHI - nmsPhi;
+		int r0 = (cells[k] % p->cRDim - HOUGH_REFINE_CELLS) * HOUGH_COARSE_R
+			- nmsR;
+
+		phi0 = phi0 < 0 ? 0 : (phi0 > p->phiDim - p->winPhi
+			? p->phiDim - p->winPhi : phi0);
+		r0 = r0 < 0 ? 0 : (r0 > p->rDim - p->winR ? p->rDim - p->winR : r0);
+		cand[2 * k] = phi0;
+		cand[2 * k + 1] = r0 - p->rNeg;
 	}
-	if(edges){
-		clReleaseMemObject(edges);
-		edges = NULL;
+
+	for(int i = 0; i < p->nbBands; i++){
+		Band* b = &p->bands[i];
+		size_t globalWorkSize[1] = {refineSize};
+		size_t refineGlobal[2] = {(size_t) p->width, (size_t) b->bufRows};
+
+		setArg(b->refineKer, 5, sizeof(int), &nbCells, "Candidates");
+
+		printf("Uploading candidates : ");
+		status = clEnqueueWriteBuffer(
+			b->queue, b->cand, CL_FALSE, 0, 2 * p->nbCand * sizeof(int),
+			cand, 0, NULL, profEvent("upload_cand", "transfer", i));
+		checkErr(status, "Failed writing buffer");
+
+		printf("Clearing refined votes : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, b->clearRefineKer, 1, NULL, globalWorkSize, NULL, 0,
+			NULL, profEvent("clear_refine", "kernel", i));
+		checkErr(status, "Failed executing kernel");
+
+		printf("Executing kernel : ");
+		status = clEnqueueNDRangeKernel(
+			b->queue, b->refineKer, 2, NULL, refineGlobal, NULL, 0, NULL,
+			profEvent("houghRefine", "kernel", i));
+		checkErr(status, "Failed executing kernel");
+
+		readBuffer(b->queue, b->refineAcc, 0, refineSize * sizeof(int),
+			part + i * refineSize, profEvent("read_refine", "transfer", i));
 	}
-	if(lines){
-		clReleaseMemObject(lines);
-		lines = NULL;
+
+	for(int i = 0; i < p->nbBands; i++){
+		clFlush(p->bands[i].queue);
+	}
+	for(int i = 0; i < p->nbBands; i++){
+		status = clFinish(p->bands[i].queue);
+		checkErr(status, "Failed waiting for the queue");
 	}
-	if(houghLineKer){
-		clReleaseKernel(houghLineKer);
-		houghLineKer = NULL;
+
+	for(int i = 0; i < p->nbBands; i++){
+		for(size_t j = 0; j < refineSize; j++){
+			refine[j] += part[i * refineSize + j];
+		}
 	}
 
+	// peaks of the fine bins of the refined cells, ties to the lower bin as
+	// houghPeak. Neighbour windows overlap, a peak is only kept once
+	int nbPeaks = 0;
+	for(int k = 0; k < nbCells; k++){
+		int* votes = refine + (size_t) k * winSize;
+		int pc = cells[k] / p->cRDim;
+		int rc = cells[k] % p->cRDim;
+
+		for(int j = 0; j < winSize; j++){
+			int i = j / p->winR;
+			int c = j % p->winR;
+			int phi = cand[2 * k] + i;
+			int r = cand[2 * k + 1] + p->rNeg + c;
+			int v = votes[j];
+
+			if(v == 0 || abs(phi / HOUGH_COARSE_PHI - pc) > HOUGH_REFINE_CELLS
+				|| abs(r / HOUGH_COARSE_R - rc) > HOUGH_REFINE_CELLS){
+				continue;
+			}
+
+			// the NMS window of a cell bin only leaves the refined one at
+			// the borders of the accumulator, where findLine clips it too
+			bool peak = true;
+			for(int di = (i < nmsPhi ? -i : -nmsPhi);
+					peak && di <= nmsPhi && i + di < p->winPhi; di++){
+				for(int dc = (c < nmsR ? -c : -nmsR);
+						peak && dc <= nmsR && c + dc < p->winR; dc++){
+					int w = votes[j + di * p->winR + dc];
+					peak = w < v || (w == v && di * p->winR + dc >= 0);
+				}
+			}
+			for(int n = 0; peak && n < nbPeaks; n++){
+				peak = lineIds[n] != phi * p->rDim + r;
+			}
+			if(peak){
+				lineVotes[nbPeaks] = v;
+				lineIds[nbPeaks] = phi * p->rDim + r;
+				nbPeaks++;
+			}
+		}
+	}
+
+	// best lines first, the lower bin on ties, id is filled from its end
+	int nb = nbPeaks < nbLine ? nbPeaks : nbLine;
+	for(int n = 0; n < nb; n++){
+		int best = n;
+		for(int j = n + 1; j < nbPeaks; j++){
+			if(lineVotes[j] > lineVotes[best] || (lineVotes[j]
+					== lineVotes[best] && lineIds[j] < lineIds[best])){
+				best = j;
+			}
+		}
+		int v = lineVotes[best];
+		int l = lineIds[best];
+		lineVotes[best] = lineVotes[n];
+		lineIds[best] = lineIds[n];
+		lineVotes[n] = v;
+		lineIds[n] = l;
+		id[nb - 1 - n] = l;
+	}
+
+	free(cells);
+	free(cand);
+	free(refine);
+	free(part);
+	free(lineVotes);
+	free(lineIds);
+	*ids = id;
+	return nb;
 }
-void findLine(int* accumulator, size_t nbLine, size_t accSize, int** ids){
+
+/**
+ * nbLine best bins of the accumulator, worst first. The scan is split on
+ * the cpu threads with a heap per thread (cpuTopK), so a large nbLine
+ * costs log(nbLine) per kept bin instead of nbLine. Only the bins that
+ * are the maximum of their (+- nmsR, +- nmsPhi) window compete, the
+ * neighbours of a line are not returned as other lines. Returns how many
+ * lines have votes.
+ */
+int findLine(int* accumulator, size_t nbLine, int rDim, int phiDim,
+		int** ids){
 	
-	int *id , *score;
+	int *id;
 	
 	printf("Find the %d most important lines\n", nbLine);
 
 	id = (int*) malloc(nbLine * sizeof(int));
-	score = (int*) malloc(nbLine * sizeof(int));
 
-	if(id == NULL || score == NULL){
+	if(id == NULL){
 		printf("Failed memory allocation\n");
 		exit(1);
 	}
 
-	for(int i = 0 ; i < nbLine ; i++){ // use calloc instead ?
-		score[i] = 0;
-		id[i] = 0;
-	}
-
-	for(int i = 0; i < accSize; i++){
-		if(accumulator[i] > score[0]){ 
-		// if vote greater than smaller value add it
-			score[0] = accumulator[i];
-			id[0] = i;
+	int nb = cpuTopK(accumulator, rDim, phiDim, nbLine, nmsR, nmsPhi, id);
 
-			for(int j = 0; j < (nbLine-1); j++){
-				if(score[j] > score[j + 1]){
-					// swap value if it is greater than before
-					int tmpS = score[j];
-					int tmpI = id[j];
-					score[j] = score[j+1];
-					score[j+1] = tmpS;
-					id[j] = id[j+1];
-					id[j+1] = tmpI;
-				}				
-			}
-		}			
-	}	
-
-	// Return id free vote count
-	free(score);
 	*ids = id;
+	return nb;
 }
 
 void cleanup(){
@@ -676,9 +2764,11 @@ void cleanup(){
 		clReleaseProgram(program);
 		program = NULL;
 	}
-	if(queue){
-		clReleaseCommandQueue(queue);
-		queue = NULL;
+	for(cl_uint i = 0; i < nbDevices; i++){
+		if(queues[i]){
+			clReleaseCommandQueue(queues[i]);
+			queues[i] = NULL;
+		}
 	}
 	if(context){
 		clReleaseContext(context);